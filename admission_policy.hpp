@@ -0,0 +1,99 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef ADMISSION_POLICY_HEADER
+#define ADMISSION_POLICY_HEADER
+
+#include <random>
+
+/**
+ * The TinyLFU admission policies that wtinylfu_cache may be configured with (its
+ * Admission parameter). When both the window and the main cache are full, the
+ * window's victim (the candidate) is admitted to the main cache, evicting the main
+ * cache's victim, only if admit returns true given the estimated access frequencies
+ * of both.
+ *
+ * $num_candidates is the number of main cache pages that are considered as its
+ * victim: the policy's own victim and, if that's a probationary page, the pages
+ * preceding it in the probationary segment (i.e. the least recently used ones with
+ * SLRU). The one with the lowest frequency is compared against the window's victim.
+ * Probationary pages with a nonzero reference count (see eviction_policy.hpp) are
+ * skipped, since their policy spared them.
+ *
+ * Regardless of the admission policy, if the probationary segment is empty (e.g.
+ * after a capacity change), SLRU offers the LRU page of eden as its victim.
+ */
+
+/** Plain TinyLFU: the candidate must be more frequent than the main cache's victim. */
+struct single_victim_admission
+{
+    static constexpr int num_candidates = 1;
+
+    bool admit(const int candidate_frequency, const int victim_frequency) noexcept
+    {
+        return candidate_frequency > victim_frequency;
+    }
+};
+
+/**
+ * Like single_victim_admission, but the candidate is compared against the least
+ * frequently used of the $N least recently used probationary pages, which makes it
+ * less likely that a frequently used page is evicted just for being the LRU one.
+ */
+template<int N>
+struct coldest_of_admission
+{
+    static_assert(N > 0, "at least one eviction candidate is required");
+
+    static constexpr int num_candidates = N;
+
+    bool admit(const int candidate_frequency, const int victim_frequency) noexcept
+    {
+        return candidate_frequency > victim_frequency;
+    }
+};
+
+/**
+ * Caffeine's rule: a candidate that is not more frequent than the victim, but is
+ * still warm (its frequency is at least $warm_frequency), is admitted with a
+ * probability of 1/128. Otherwise, with skewed workloads, a victim that's about as
+ * hot as the warm candidates entering the cache may linger indefinitely, as may a
+ * victim whose frequency was inflated by hash collisions.
+ *
+ * This is the only policy here that is not deterministic, and thus the only one
+ * that keeps an attacker who inflated a victim's frequency from pinning it for
+ * certain; it's not the default.
+ */
+struct caffeine_admission
+{
+    static constexpr int num_candidates = 1;
+    static constexpr int warm_frequency = 6;
+
+    std::minstd_rand rng{std::random_device()()};
+
+    bool admit(const int candidate_frequency, const int victim_frequency)
+    {
+        if(candidate_frequency > victim_frequency) { return true; }
+        return candidate_frequency >= warm_frequency && (rng() & 127) == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,394 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef ASYNC_WTINYLFU_HEADER
+#define ASYNC_WTINYLFU_HEADER
+
+#include "wtinylfu.hpp"
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+#if defined(__cpp_impl_coroutine)
+# include <coroutine>
+#endif
+
+/**
+ * The eventual result of a load started by async_wtinylfu_cache. Copies share the
+ * same underlying state.
+ *
+ * The result can be waited for (get), have a callback attached to it (then), or,
+ * when compiled with coroutine support, be co_await-ed. Continuations and resumed
+ * coroutines run on the thread that completes the load, i.e. one of the executor's.
+ */
+template<typename V>
+class async_value
+{
+    struct state
+    {
+        std::mutex mutex;
+        std::condition_variable ready_cond;
+        bool is_ready = false;
+        std::shared_ptr<V> value;
+        std::exception_ptr error;
+        std::vector<std::function<void()>> continuations;
+
+        // When $value was last (re)loaded, and whether a refresh is in progress.
+        std::chrono::steady_clock::time_point loaded_at;
+        bool is_refreshing = false;
+    };
+
+    std::shared_ptr<state> state_;
+
+    template<typename, typename, typename> friend class async_wtinylfu_cache;
+
+public:
+    /** Creates an invalid instance, which is not associated with any load. */
+    async_value() = default;
+
+    bool is_valid() const noexcept { return state_ != nullptr; }
+
+    bool is_ready() const
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->is_ready;
+    }
+
+    /**
+     * Blocks until the load completes, then returns its value or rethrows the
+     * exception with which the loader failed.
+     */
+    std::shared_ptr<V> get() const
+    {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->ready_cond.wait(lock, [this] { return state_->is_ready; });
+        if(state_->error) { std::rethrow_exception(state_->error); }
+        return state_->value;
+    }
+
+    /**
+     * Invokes $continuation once the load completes. If it already has, $continuation
+     * is invoked immediately, on the calling thread.
+     */
+    void then(std::function<void()> continuation)
+    {
+        if(!try_attach(continuation)) { continuation(); }
+    }
+
+    /** Two instances are equal if they refer to the same load. */
+    bool operator==(const async_value& other) const noexcept
+    {
+        return state_ == other.state_;
+    }
+
+    bool operator!=(const async_value& other) const noexcept
+    {
+        return !(*this == other);
+    }
+
+#if defined(__cpp_impl_coroutine)
+    bool await_ready() const { return is_ready(); }
+
+    bool await_suspend(std::coroutine_handle<> coroutine)
+    {
+        return try_attach([coroutine] { coroutine.resume(); });
+    }
+
+    std::shared_ptr<V> await_resume() const { return get(); }
+#endif
+
+private:
+    static async_value make_pending()
+    {
+        async_value v;
+        v.state_ = std::make_shared<state>();
+        return v;
+    }
+
+    static async_value make_ready(std::shared_ptr<V> value)
+    {
+        async_value v = make_pending();
+        v.state_->is_ready = true;
+        v.state_->value = std::move(value);
+        v.state_->loaded_at = std::chrono::steady_clock::now();
+        return v;
+    }
+
+    /**
+     * Attaches $continuation to be run on completion. Returns false and doesn't
+     * attach it if the load has already completed.
+     */
+    bool try_attach(std::function<void()> continuation)
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if(state_->is_ready) { return false; }
+        state_->continuations.push_back(std::move(continuation));
+        return true;
+    }
+
+    void set_value(std::shared_ptr<V> value) { complete(std::move(value), nullptr); }
+    void set_exception(std::exception_ptr error) { complete(nullptr, std::move(error)); }
+
+    void complete(std::shared_ptr<V> value, std::exception_ptr error)
+    {
+        std::vector<std::function<void()>> continuations;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            state_->value = std::move(value);
+            state_->error = std::move(error);
+            state_->is_ready = true;
+            state_->loaded_at = std::chrono::steady_clock::now();
+            continuations.swap(state_->continuations);
+        }
+        state_->ready_cond.notify_all();
+        for(auto& continuation : continuations) { continuation(); }
+    }
+
+    /**
+     * Returns true and marks the value as being refreshed if it was successfully
+     * loaded at least $interval ago and no refresh is already in progress.
+     */
+    bool try_begin_refresh(const std::chrono::steady_clock::duration interval)
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if(!state_->is_ready || state_->error || state_->is_refreshing
+           || std::chrono::steady_clock::now() - state_->loaded_at < interval)
+        {
+            return false;
+        }
+        state_->is_refreshing = true;
+        return true;
+    }
+
+    /**
+     * Ends a refresh begun with try_begin_refresh. If $value is null (the reload
+     * failed) the old value is kept, and is due for refresh again on the next
+     * access.
+     */
+    void finish_refresh(std::shared_ptr<V> value)
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if(value != nullptr)
+        {
+            state_->value = std::move(value);
+            state_->loaded_at = std::chrono::steady_clock::now();
+        }
+        state_->is_refreshing = false;
+    }
+};
+
+/** The default executor of async_wtinylfu_cache: runs each task on a new thread. */
+struct detached_thread_executor
+{
+    void operator()(std::function<void()> task) const
+    {
+        std::thread(std::move(task)).detach();
+    }
+};
+
+/**
+ * A thread-safe, non-blocking front for wtinylfu_cache.
+ *
+ * get never runs the loader on the calling thread: on a miss it stores a pending
+ * async_value in the cache right away and submits the load to $Executor (any
+ * callable taking a std::function<void()>). Concurrent requests for the same key
+ * find that pending entry and share its result, so each key is loaded only once. A
+ * failed load is removed from the cache, so the next request retries it.
+ *
+ * Since the cached entries are the loads themselves, a pending entry takes part in
+ * the eviction policy like any other entry.
+ *
+ * Optionally, entries can be refreshed after write (see set_refresh_interval): an
+ * access to an entry older than the refresh interval returns the current value
+ * immediately and submits a reload to the executor (stale-while-revalidate). The
+ * reloaded value replaces the old one in place, so the entry keeps its position in
+ * the eviction policy as well as its access frequency.
+ */
+template<
+    typename K,
+    typename V,
+    typename Executor = detached_thread_executor
+> class async_wtinylfu_cache
+{
+    // Pending loads refer to this weakly, so the cache may be destroyed while
+    // loads are still in progress.
+    struct shared_state
+    {
+        std::mutex mutex;
+        wtinylfu_cache<K, async_value<V>> cache;
+
+        explicit shared_state(int capacity) : cache(capacity) {}
+    };
+
+    std::shared_ptr<shared_state> state_;
+    Executor executor_;
+
+    // Zero means that entries are never refreshed.
+    std::chrono::steady_clock::duration refresh_interval_{0};
+
+public:
+    explicit async_wtinylfu_cache(int capacity, Executor executor = Executor())
+        : state_(std::make_shared<shared_state>(capacity))
+        , executor_(std::move(executor))
+    {}
+
+    int size() const
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->cache.size();
+    }
+
+    int capacity() const
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->cache.capacity();
+    }
+
+    bool contains(const K& key) const
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->cache.contains(key);
+    }
+
+    /**
+     * Sets how long after being (re)loaded an entry is reloaded in the background
+     * upon its next access through get. A zero $interval disables refreshing.
+     *
+     * NOTE: not synchronized with concurrent calls to get, so set this before the
+     * cache is shared between threads.
+     */
+    void set_refresh_interval(const std::chrono::steady_clock::duration interval)
+    {
+        refresh_interval_ = interval;
+    }
+
+    /**
+     * Returns the (possibly still pending) value of $key. If there's no entry for
+     * $key, a load is submitted to the executor which calls $value_loader(key) and
+     * expects a V in return.
+     */
+    template<typename ValueLoader>
+    async_value<V> get(const K& key, ValueLoader value_loader)
+    {
+        async_value<V> load;
+        bool is_hit = false;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            std::shared_ptr<async_value<V>> entry = state_->cache.get(key);
+            if(entry != nullptr)
+            {
+                load = *entry;
+                is_hit = true;
+            }
+            else
+            {
+                load = async_value<V>::make_pending();
+                state_->cache.insert(key, load);
+            }
+        }
+
+        // Like loads, refreshes are submitted without holding the lock, so that an
+        // executor that runs them inline doesn't reload under it.
+        if(is_hit)
+        {
+            maybe_refresh(key, load, value_loader);
+            return load;
+        }
+
+        std::weak_ptr<shared_state> weak_state = state_;
+        executor_([weak_state, key, load, value_loader]() mutable
+        {
+            std::shared_ptr<V> value;
+            try
+            {
+                value = std::make_shared<V>(value_loader(key));
+            }
+            catch(...)
+            {
+                if(auto state = weak_state.lock())
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    auto entry = state->cache.peek(key);
+                    if(entry != nullptr && *entry == load) { state->cache.erase(key); }
+                }
+                load.set_exception(std::current_exception());
+                return;
+            }
+            load.set_value(std::move(value));
+        });
+        return load;
+    }
+
+    /** Returns the value of $key if present (which may still be loading). */
+    async_value<V> get_if_present(const K& key)
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        std::shared_ptr<async_value<V>> entry = state_->cache.get(key);
+        return entry != nullptr ? *entry : async_value<V>();
+    }
+
+    void insert(K key, V value)
+    {
+        auto ready = async_value<V>::make_ready(std::make_shared<V>(std::move(value)));
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->cache.insert(std::move(key), std::move(ready));
+    }
+
+    void erase(const K& key)
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->cache.erase(key);
+    }
+
+private:
+    template<typename ValueLoader>
+    void maybe_refresh(const K& key, async_value<V> entry, ValueLoader value_loader)
+    {
+        if(refresh_interval_ == refresh_interval_.zero()
+           || !entry.try_begin_refresh(refresh_interval_))
+        {
+            return;
+        }
+
+        executor_([key, entry, value_loader]() mutable
+        {
+            std::shared_ptr<V> value;
+            try
+            {
+                value = std::make_shared<V>(value_loader(key));
+            }
+            catch(...)
+            {
+                // Keep serving the old value.
+            }
+            entry.finish_refresh(std::move(value));
+        });
+    }
+};
+
+#endif
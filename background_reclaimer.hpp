@@ -0,0 +1,99 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef BACKGROUND_RECLAIMER_HEADER
+#define BACKGROUND_RECLAIMER_HEADER
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <condition_variable>
+
+/**
+ * Releases batches of objects on a background thread, so that the thread handing
+ * them over doesn't pay for running their destructors and freeing their memory.
+ *
+ * Meant to be used with wtinylfu_cache's deferred reclamation:
+ *
+ *     cache.set_deferred_reclamation(true);
+ *     ...
+ *     reclaimer.submit(cache.take_reclaimable());
+ */
+class background_reclaimer
+{
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    // Type erased batches; releasing one destroys the batch and its elements.
+    std::deque<std::shared_ptr<void>> batches_;
+    bool is_stopped_ = false;
+    std::thread thread_;
+
+public:
+    background_reclaimer() : thread_([this] { run(); }) {}
+
+    background_reclaimer(const background_reclaimer&) = delete;
+    background_reclaimer& operator=(const background_reclaimer&) = delete;
+
+    /** Releases the batches that are still queued, then stops the thread. */
+    ~background_reclaimer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopped_ = true;
+        }
+        cond_.notify_one();
+        thread_.join();
+    }
+
+    /** Takes ownership of $batch (e.g. a container of shared_ptrs) to release it. */
+    template<typename Batch>
+    void submit(Batch&& batch)
+    {
+        auto erased = std::make_shared<typename std::decay<Batch>::type>(
+            std::forward<Batch>(batch));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batches_.push_back(std::move(erased));
+        }
+        cond_.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true)
+        {
+            cond_.wait(lock, [this] { return !batches_.empty() || is_stopped_; });
+            if(batches_.empty()) { break; }
+
+            std::shared_ptr<void> batch = std::move(batches_.front());
+            batches_.pop_front();
+            lock.unlock();
+            batch.reset();
+            lock.lock();
+        }
+    }
+};
+
+#endif
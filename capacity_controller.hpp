@@ -0,0 +1,222 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef CAPACITY_CONTROLLER_HEADER
+#define CAPACITY_CONTROLLER_HEADER
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+/**
+ * Adjusts the capacity of a cache so that memory use stays within a budget.
+ *
+ * Each call to adjust measures memory use with a probe (by default the cgroup's
+ * memory.current, but it may just as well be the weighed size of the cache's
+ * entries or the allocator's statistics) and scales the capacity in proportion to
+ * how far the measured use is from the budget. Additionally, if memory pressure is
+ * reported above a threshold, the cache is shrunk regardless. Pressure is measured
+ * by another probe, by default the cgroup's memory.pressure (Linux PSI); the system
+ * wide /proc/pressure/memory is only used if $system_wide_pressure is set, since
+ * it reflects every process on the host.
+ *
+ * To keep each adjustment cheap and the control loop stable, the capacity changes by
+ * at most $max_step of its current value per call, and a shrink evicts at most
+ * $max_evictions entries right away, leaving the rest of the excess to be evicted
+ * by subsequent insertions (see wtinylfu_cache::change_capacity_incrementally).
+ * It's meant to be called periodically, e.g. from a maintenance thread.
+ *
+ * $Cache may be any cache with the capacity, size, change_capacity_incrementally,
+ * num_excess_entries and evict_excess methods of wtinylfu_cache, e.g. synchronized_wtinylfu_cache,
+ * which makes it safe to call adjust from another thread.
+ */
+template<typename Cache>
+class capacity_controller
+{
+public:
+    struct options
+    {
+        // The upper bound, in bytes, on the memory use reported by the probe.
+        uint64_t memory_budget = 0;
+
+        // The maximum fraction of the current capacity added or removed per step.
+        double max_step = 0.05;
+
+        // The bounds of the capacity. A cache needs room for at least one window and
+        // one main cache entry, so the minimum is 2, or more if the cache's window
+        // ratio is large (see wtinylfu_cache::min_capacity).
+        int min_capacity = 2;
+        int max_capacity = std::numeric_limits<int>::max();
+
+        // The maximum number of entries evicted by a step that shrinks the cache.
+        int max_evictions = 1000;
+
+        // If the share of time some tasks stalled on memory over the last 10 seconds
+        // exceeds this percentage, the cache is shrunk.
+        double max_memory_pressure = 10.0;
+
+        // The cgroup (v2) whose memory.current and memory.pressure are read.
+        std::string cgroup_path = "/sys/fs/cgroup";
+
+        // Whether to fall back to /proc/pressure/memory if the cgroup's
+        // memory.pressure can't be read.
+        bool system_wide_pressure = false;
+    };
+
+    /** Returns the measured memory use in bytes, or 0 if it couldn't be measured. */
+    using memory_probe = std::function<uint64_t()>;
+
+    /**
+     * Returns the measured memory pressure as a percentage of stalled time (see
+     * read_memory_pressure), or 0 if it couldn't be measured.
+     */
+    using pressure_probe = std::function<double()>;
+
+private:
+    Cache& cache_;
+    options options_;
+    memory_probe probe_;
+    pressure_probe pressure_probe_;
+
+public:
+    capacity_controller(Cache& cache, options opts, memory_probe probe = memory_probe(),
+        pressure_probe pressure = pressure_probe())
+        : cache_(cache)
+        , options_(std::move(opts))
+        , probe_(std::move(probe))
+        , pressure_probe_(std::move(pressure))
+    {
+        if(options_.memory_budget == 0)
+        {
+            throw std::invalid_argument("memory budget must be greater than zero");
+        }
+        if(options_.max_step <= 0 || options_.max_step >= 1)
+        {
+            throw std::invalid_argument("max step must be in (0, 1)");
+        }
+        if(options_.min_capacity < 2 || options_.min_capacity > options_.max_capacity)
+        {
+            throw std::invalid_argument("invalid capacity bounds");
+        }
+        if(options_.max_evictions <= 0)
+        {
+            throw std::invalid_argument("max evictions must be greater than zero");
+        }
+        if(!probe_)
+        {
+            const std::string path = options_.cgroup_path + "/memory.current";
+            probe_ = [path] { return read_memory_current(path); };
+        }
+        if(!pressure_probe_)
+        {
+            const std::string path = options_.cgroup_path + "/memory.pressure";
+            const bool system_wide = options_.system_wide_pressure;
+            pressure_probe_ = [path, system_wide]
+            {
+                double pressure = 0;
+                if(!read_memory_pressure(path, pressure) && system_wide)
+                {
+                    read_memory_pressure("/proc/pressure/memory", pressure);
+                }
+                return pressure;
+            };
+        }
+    }
+
+    /**
+     * Performs one control step and returns the (possibly new) capacity. While the
+     * entries over capacity after a previous shrink are still being evicted, the
+     * step only evicts more of them, as the memory they hold is still measured.
+     */
+    int adjust()
+    {
+        const int capacity = cache_.capacity();
+        const int max_evictions = options_.max_evictions
+            - cache_.evict_excess(options_.max_evictions);
+        if(cache_.num_excess_entries() > 0) { return capacity; }
+
+        const uint64_t usage = probe_();
+        const double pressure = pressure_probe_();
+
+        double target = capacity;
+        if(usage > 0)
+        {
+            target = capacity * double(options_.memory_budget) / usage;
+            // No point in growing a cache that doesn't use its current capacity.
+            if(target > capacity && cache_.size() < capacity) { target = capacity; }
+        }
+        if(pressure > options_.max_memory_pressure)
+        {
+            target = std::min(target, capacity * (1 - options_.max_step));
+        }
+
+        const double max_change = std::max(1.0, capacity * options_.max_step);
+        target = std::max(capacity - max_change, std::min(capacity + max_change, target));
+        const int new_capacity = std::max<double>(options_.min_capacity,
+            std::min<double>(options_.max_capacity, std::floor(target)));
+
+        if(new_capacity != capacity)
+        {
+            cache_.change_capacity_incrementally(new_capacity);
+            cache_.evict_excess(max_evictions);
+        }
+        return new_capacity;
+    }
+
+    /** Reads a cgroup v2 memory.current file. Returns 0 if it can't be read. */
+    static uint64_t read_memory_current(const std::string& path)
+    {
+        std::ifstream file(path);
+        uint64_t bytes = 0;
+        if(!(file >> bytes)) { return 0; }
+        return bytes;
+    }
+
+    /**
+     * Reads the "some avg10" value (the percentage of the last 10 seconds in which
+     * at least one task stalled on memory) from a PSI file, such as a cgroup's
+     * memory.pressure or /proc/pressure/memory, into $pressure. Returns false if the
+     * file can't be read.
+     */
+    static bool read_memory_pressure(const std::string& path, double& pressure)
+    {
+        std::ifstream file(path);
+        std::string line;
+        while(std::getline(file, line))
+        {
+            // Format: some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+            if(line.compare(0, 5, "some ") != 0) { continue; }
+            const auto pos = line.find("avg10=");
+            if(pos == std::string::npos) { continue; }
+            std::istringstream value(line.substr(pos + 6));
+            if(value >> pressure) { return true; }
+        }
+        return false;
+    }
+};
+
+#endif
@@ -25,6 +25,9 @@
 
 namespace detail
 {
+    /** A placeholder value type for caches that only store keys. */
+    struct empty {};
+
     // This is Bob Jenkins' One-at-a-Time hash, see:
     // http://www.burtleburtle.net/bob/hash/doobs.html
     template<typename T>
@@ -47,6 +50,40 @@ namespace detail
         return hash;
     }
 
+    /**
+     * The murmur3 finalizer: spreads the bits of a hash that wasn't made to be
+     * uniformly distributed, e.g. before comparing it against a sampling threshold.
+     */
+    constexpr uint32_t mix(uint32_t h) noexcept
+    {
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        return h;
+    }
+
+    /** The 64 bit murmur3 finalizer. */
+    constexpr uint64_t mix64(uint64_t h) noexcept
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /**
+     * Folds a std::hash (which is often the identity for integers) into a uniformly
+     * distributed 32 bit hash.
+     */
+    constexpr uint32_t fold_hash(const std::size_t h) noexcept
+    {
+        return uint32_t(mix64(uint64_t(h)) >> 32);
+    }
+
     /** Returns the number of set bits in x. Also known as Hamming Weight. */
     template<
         typename T,
@@ -68,6 +105,16 @@ namespace detail
         ++x;
         return x;
     }
+
+    /** Hints the CPU to start loading the cache line at $address. */
+    inline void prefetch(const void* address) noexcept
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#else
+        (void)address;
+#endif
+    }
 } // namespace detail
 
 #endif
@@ -0,0 +1,742 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef EVICTION_POLICY_HEADER
+#define EVICTION_POLICY_HEADER
+
+#include "detail.hpp"
+
+#include <list>
+#include <deque>
+#include <random>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <cassert>
+
+namespace detail
+{
+    /** The segment of a wtinylfu_cache in which a page resides. */
+    enum class cache_slot : uint8_t
+    {
+        window,
+        probationary,
+        eden
+    };
+} // namespace detail
+
+/**
+ * The segments and eviction policies out of which wtinylfu_cache is built.
+ *
+ * All of them hold pages in std::list nodes, so that the page map's positions stay
+ * valid for as long as a page is cached, and so that a page can be handed over from
+ * the window to the main cache without being copied. $Page has the following
+ * members that the policies may use:
+ *
+ *     using key_type = ...;
+ *     key_type key;
+ *     detail::cache_slot cache_slot;
+ *     // A small counter for the CLOCK based segments and policies, e.g. a
+ *     // reference bit or an access frequency. Zero for new pages and for pages
+ *     // that were just admitted to the main cache.
+ *     uint8_t reference_count;
+ *     // When the page was last moved to the MRU position of its LRU segment, in
+ *     // terms of the segment's promotion counter (see lru_segment).
+ *     uint32_t promoted_at;
+ *
+ * A main cache policy (the MainPolicy parameter of wtinylfu_cache) decides which of
+ * the pages admitted from the window is the next eviction candidate, which TinyLFU
+ * then pits against the window's victim. Its interface is that of slru_policy:
+ *
+ *     explicit Policy(int capacity);
+ *     int size() const;
+ *     int capacity() const;
+ *     bool is_full() const;
+ *     void set_capacity(int n);           // NOTE: doesn't evict pages (see lru_segment)
+ *     page_position victim_pos();         // may reorder pages (e.g. a clock sweep)
+ *     const key_type& victim_key();
+ *     void evict();                       // erases the page at victim_pos
+ *     void erase(page_position page);
+ *     void clear();
+ *     void transfer_page_from(page_position page, lru_segment<Page>& source);
+ *     void handle_hit(page_position page);
+ *     void set_lazy_promotion(float fraction); // may be a no-op
+ *     bool append(page_position& pos, const key_type& key, cache_slot slot, ...);
+ *     const lru_segment<Page>& eden() const;
+ *     const lru_segment<Page>& probationary() const;
+ *
+ * The last three are used to save and restore snapshots: pages are saved from
+ * eden() and probationary(), listed from the first to the last page to be evicted
+ * (roughly), and restored in the same order with append.
+ */
+
+/** A plain LRU list of pages. Serves as the window cache and as a building block. */
+template<typename Page>
+class lru_segment
+{
+    using K = typename Page::key_type;
+
+    std::list<Page> lru_;
+    int capacity_;
+
+    // Incremented whenever a page is moved to the MRU position.
+    uint32_t num_promotions_ = 0;
+    // See set_lazy_promotion.
+    float lazy_promotion_ = 0;
+
+public:
+    using page_position = typename std::list<Page>::iterator;
+    using const_page_position = typename std::list<Page>::const_iterator;
+
+    explicit lru_segment(int capacity) : capacity_(capacity) {}
+
+    int size() const noexcept { return lru_.size(); }
+    int capacity() const noexcept { return capacity_; }
+    bool is_full() const noexcept { return size() >= capacity(); }
+
+    /**
+     * NOTE: doesn't actually remove any pages, it only sets the capacity.
+     *
+     * This is because otherwise there'd be no way to delete the corresponding
+     * entries from the page map outside of this LRU instance, so this is handled
+     * externally.
+     */
+    void set_capacity(const int n) noexcept { capacity_ = n; }
+
+    /** Returns the position of the hottest (most recently used) page. */
+    page_position mru_pos() noexcept { return lru_.begin(); }
+    const_page_position mru_pos() const noexcept { return lru_.begin(); }
+
+    /** Returns the position of the coldest (least recently used) page. */
+    page_position lru_pos() noexcept { return --lru_.end(); }
+    const_page_position lru_pos() const noexcept { return --lru_.end(); }
+
+    const K& victim_key() const noexcept
+    {
+        return lru_pos()->key;
+    }
+
+    void evict()
+    {
+        erase(lru_pos());
+    }
+
+    void erase(page_position page)
+    {
+        lru_.erase(page);
+    }
+
+    /**
+     * If $fraction is greater than zero, a hit on a page that is still among the
+     * $fraction * capacity() most recently promoted pages leaves it where it is,
+     * which saves the list writes of most hits on hot pages, while the order of the
+     * colder pages, from which victims are chosen, is the same as with full LRU.
+     *
+     * Whether a page is recent is decided by stamping it with a counter of MRU
+     * promotions: fewer promotions since its own means that fewer pages were placed
+     * in front of it.
+     */
+    void set_lazy_promotion(const float fraction) noexcept
+    {
+        lazy_promotion_ = fraction;
+    }
+
+    /** Inserts new page at the MRU position of the cache. */
+    template<typename... Args>
+    page_position insert(Args&&... args)
+    {
+        auto page = lru_.emplace(mru_pos(), std::forward<Args>(args)...);
+        page->promoted_at = ++num_promotions_;
+        return page;
+    }
+
+    /**
+     * Inserts new page at the LRU position of the cache. Used to rebuild a cache
+     * from its pages listed from MRU to LRU.
+     */
+    template<typename... Args>
+    page_position append(Args&&... args)
+    {
+        auto page = lru_.emplace(lru_.end(), std::forward<Args>(args)...);
+        // As if promoted long enough ago to never be considered recent.
+        page->promoted_at = num_promotions_ - uint32_t(capacity_);
+        return page;
+    }
+
+    void clear() noexcept
+    {
+        lru_.clear();
+    }
+
+    /** Pages are iterated from the MRU to the LRU position. */
+    const_page_position begin() const noexcept { return lru_.begin(); }
+    const_page_position end() const noexcept { return lru_.end(); }
+
+    /**
+     * Moves page to the MRU position, unless it was promoted recently (see
+     * set_lazy_promotion).
+     */
+    void handle_hit(page_position page)
+    {
+        if(is_recently_promoted(page)) { return; }
+        transfer_page_from(page, *this);
+    }
+
+    /** Moves page from $source to the MRU position of this cache. */
+    void transfer_page_from(page_position page, lru_segment& source)
+    {
+        lru_.splice(mru_pos(), source.lru_, page);
+        page->promoted_at = ++num_promotions_;
+    }
+
+private:
+    bool is_recently_promoted(const_page_position page) const noexcept
+    {
+        return lazy_promotion_ > 0
+            && num_promotions_ - page->promoted_at < lazy_promotion_ * capacity_;
+    }
+};
+
+/**
+ * An LRU segment approximated with CLOCK (second chance): a hit only sets the page's
+ * reference bit, instead of moving the page to the MRU position, so hits don't
+ * write to any list nodes. Looking for the victim sweeps the clock hand (the LRU
+ * position) over the pages, moving those whose bit is set back to the MRU position
+ * and clearing their bit, until it finds a page whose bit is not set.
+ *
+ * May be used as the window cache (see wtinylfu_cache's WindowSegment parameter).
+ */
+template<typename Page>
+class clock_segment : public lru_segment<Page>
+{
+    using base = lru_segment<Page>;
+    using K = typename Page::key_type;
+
+public:
+    using page_position = typename base::page_position;
+
+    explicit clock_segment(int capacity) : base(capacity) {}
+
+    /** Advances the clock hand to the first page whose reference bit is not set. */
+    page_position lru_pos() noexcept
+    {
+        // Terminates in at most size() steps, as each step clears a reference bit.
+        while(base::lru_pos()->reference_count > 0)
+        {
+            auto page = base::lru_pos();
+            page->reference_count = 0;
+            base::transfer_page_from(page, *this);
+        }
+        return base::lru_pos();
+    }
+
+    const K& victim_key() noexcept
+    {
+        return lru_pos()->key;
+    }
+
+    void evict()
+    {
+        base::erase(lru_pos());
+    }
+
+    void handle_hit(page_position page) noexcept
+    {
+        page->reference_count = 1;
+    }
+};
+
+/**
+ * A cache which is divided into two segments, a probationary and an eden
+ * segment. Both are LRU caches.
+ *
+ * Pages that are cache hits are promoted to the top (MRU position) of the eden
+ * segment, regardless of the segment in which they currently reside. Thus, pages
+ * within the eden segment have been accessed at least twice.
+ *
+ * Pages that are cache misses are added to the cache at the MRU position of the
+ * probationary segment.
+ *
+ * Each segment is finite in size, so the migration of a page from the probationary
+ * segment may force the LRU page of the eden segment into the MRU position of
+ * the probationary segment, giving it another chance. Likewise, if both segments
+ * reach their capacity, a new entry is replaced with the LRU victim of the
+ * probationary segment.
+ *
+ * In this implementation 80% of the capacity is allocated to the eden (or "hot")
+ * pages and 20% for pages under probation (the "cold" pages).
+ *
+ * This is the default main cache policy, and the one W-TinyLFU was evaluated with.
+ */
+template<typename Page>
+class slru_policy
+{
+    using K = typename Page::key_type;
+    using cache_slot = detail::cache_slot;
+    using lru = lru_segment<Page>;
+
+    lru eden_;
+    lru probationary_;
+
+public:
+    using page_position = typename lru::page_position;
+    using const_page_position = typename lru::const_page_position;
+
+    explicit slru_policy(int capacity)
+        : slru_policy(0.8f * capacity, capacity - 0.8f * capacity)
+    {
+        // correct truncation error
+        if(this->capacity() < capacity)
+        {
+            eden_.set_capacity(eden_.capacity() + 1);
+        }
+    }
+
+    slru_policy(int eden_capacity, int probationary_capacity)
+        : eden_(eden_capacity)
+        , probationary_(probationary_capacity)
+    {}
+
+    int size() const noexcept
+    {
+        return eden_.size() + probationary_.size();
+    }
+
+    int capacity() const noexcept
+    {
+        return eden_.capacity() + probationary_.capacity();
+    }
+
+    bool is_full() const noexcept
+    {
+        return size() >= capacity();
+    }
+
+    void set_capacity(const int n)
+    {
+        eden_.set_capacity(0.8f * n);
+        probationary_.set_capacity(n - eden_.capacity());
+    }
+
+    /**
+     * Only applies to hits in eden, as probationary pages that are hit must always
+     * be promoted to eden.
+     */
+    void set_lazy_promotion(const float fraction) noexcept
+    {
+        eden_.set_lazy_promotion(fraction);
+    }
+
+    /**
+     * Returns the LRU page of the probationary segment, or, if that's empty
+     * (e.g. after the capacity was reduced and eden holds all pages), the LRU
+     * page of eden.
+     */
+    page_position victim_pos() noexcept
+    {
+        return probationary_.size() > 0 ? probationary_.lru_pos() : eden_.lru_pos();
+    }
+
+    const K& victim_key() noexcept
+    {
+        return victim_pos()->key;
+    }
+
+    const lru& eden() const noexcept { return eden_; }
+    const lru& probationary() const noexcept { return probationary_; }
+
+    void evict()
+    {
+        erase(victim_pos());
+    }
+
+    void clear() noexcept
+    {
+        eden_.clear();
+        probationary_.clear();
+    }
+
+    /**
+     * Inserts new page at the LRU position of the segment denoted by $slot. If
+     * eden is full, an eden page is placed in the probationary segment instead
+     * (which, like in regular operation, may take up any capacity eden doesn't
+     * use). Returns false (and inserts nothing) if the cache is full.
+     */
+    template<typename... Args>
+    bool append(page_position& pos, const K& key, cache_slot slot, Args&&... args)
+    {
+        if(is_full()) { return false; }
+        if(slot == cache_slot::eden && !eden_.is_full())
+            pos = eden_.append(key, slot, std::forward<Args>(args)...);
+        else
+            pos = probationary_.append(key, cache_slot::probationary,
+                std::forward<Args>(args)...);
+        return true;
+    }
+
+    void erase(page_position page)
+    {
+        if(page->cache_slot == cache_slot::eden)
+            eden_.erase(page);
+        else
+            probationary_.erase(page);
+    }
+
+    /** Moves page to the MRU position of the probationary segment. */
+    void transfer_page_from(page_position page, lru& source)
+    {
+        probationary_.transfer_page_from(page, source);
+        page->cache_slot = cache_slot::probationary;
+        page->reference_count = 0;
+    }
+
+    /**
+     * If page is in the probationary segment:
+     * promotes page to the MRU position of the eden segment, and if eden segment
+     * capacity is reached, moves the LRU page of the eden segment to the MRU
+     * position of the probationary segment.
+     *
+     * Otherwise, page is in eden:
+     * promotes page to the MRU position of eden.
+     */
+    void handle_hit(page_position page)
+    {
+        if(page->cache_slot == cache_slot::probationary)
+        {
+            promote_to_eden(page);
+            if(eden_.is_full()) { demote_to_probationary(eden_.lru_pos()); }
+        }
+        else
+        {
+            assert(page->cache_slot == cache_slot::eden); // this shouldn't happen
+            eden_.handle_hit(page);
+        }
+    }
+
+private:
+    void promote_to_eden(page_position page)
+    {
+        eden_.transfer_page_from(page, probationary_);
+        page->cache_slot = cache_slot::eden;
+    }
+
+    void demote_to_probationary(page_position page)
+    {
+        probationary_.transfer_page_from(page, eden_);
+        page->cache_slot = cache_slot::probationary;
+    }
+};
+
+/**
+ * A single LRU list. Admitted pages start out at the MRU position, so unlike with
+ * SLRU, a page that was accessed only once before being admitted is not evicted
+ * before older pages that were accessed repeatedly. Suits recency-biased workloads.
+ *
+ * All pages are kept in the eden slot.
+ */
+template<typename Page>
+class lru_policy
+{
+    using K = typename Page::key_type;
+    using cache_slot = detail::cache_slot;
+    using lru = lru_segment<Page>;
+
+    lru lru_;
+    // Always empty, see probationary().
+    lru probationary_;
+
+public:
+    using page_position = typename lru::page_position;
+
+    explicit lru_policy(int capacity) : lru_(capacity), probationary_(0) {}
+
+    int size() const noexcept { return lru_.size(); }
+    int capacity() const noexcept { return lru_.capacity(); }
+    bool is_full() const noexcept { return lru_.is_full(); }
+    void set_capacity(const int n) noexcept { lru_.set_capacity(n); }
+    void set_lazy_promotion(const float fraction) noexcept
+    {
+        lru_.set_lazy_promotion(fraction);
+    }
+
+    page_position victim_pos() noexcept { return lru_.lru_pos(); }
+    const K& victim_key() noexcept { return lru_.victim_key(); }
+
+    const lru& eden() const noexcept { return lru_; }
+    const lru& probationary() const noexcept { return probationary_; }
+
+    void evict() { lru_.evict(); }
+    void erase(page_position page) { lru_.erase(page); }
+    void clear() noexcept { lru_.clear(); }
+
+    template<typename... Args>
+    bool append(page_position& pos, const K& key, cache_slot, Args&&... args)
+    {
+        if(is_full()) { return false; }
+        pos = lru_.append(key, cache_slot::eden, std::forward<Args>(args)...);
+        return true;
+    }
+
+    void transfer_page_from(page_position page, lru& source)
+    {
+        lru_.transfer_page_from(page, source);
+        page->cache_slot = cache_slot::eden;
+        page->reference_count = 0;
+    }
+
+    void handle_hit(page_position page) { lru_.handle_hit(page); }
+};
+
+/**
+ * A single clock_segment: hits only set the page's reference bit, so, unlike with
+ * the LRU based policies, they don't reorder the list. Approximates LRU with cheaper
+ * hits.
+ *
+ * All pages are kept in the eden slot.
+ */
+template<typename Page>
+class clock_policy
+{
+    using K = typename Page::key_type;
+    using cache_slot = detail::cache_slot;
+    using lru = lru_segment<Page>;
+
+    clock_segment<Page> clock_;
+    // Always empty, see probationary().
+    lru probationary_;
+
+public:
+    using page_position = typename lru::page_position;
+
+    explicit clock_policy(int capacity) : clock_(capacity), probationary_(0) {}
+
+    int size() const noexcept { return clock_.size(); }
+    int capacity() const noexcept { return clock_.capacity(); }
+    bool is_full() const noexcept { return clock_.is_full(); }
+    void set_capacity(const int n) noexcept { clock_.set_capacity(n); }
+    // Hits don't move pages anyway.
+    void set_lazy_promotion(float) noexcept {}
+
+    page_position victim_pos() noexcept { return clock_.lru_pos(); }
+    const K& victim_key() noexcept { return clock_.victim_key(); }
+
+    const lru& eden() const noexcept { return clock_; }
+    const lru& probationary() const noexcept { return probationary_; }
+
+    void evict() { clock_.evict(); }
+    void erase(page_position page) { clock_.erase(page); }
+    void clear() noexcept { clock_.clear(); }
+
+    template<typename... Args>
+    bool append(page_position& pos, const K& key, cache_slot, Args&&... args)
+    {
+        if(is_full()) { return false; }
+        pos = clock_.append(key, cache_slot::eden, std::forward<Args>(args)...);
+        return true;
+    }
+
+    void transfer_page_from(page_position page, lru& source)
+    {
+        clock_.transfer_page_from(page, source);
+        page->cache_slot = cache_slot::eden;
+        page->reference_count = 0;
+    }
+
+    void handle_hit(page_position page) noexcept { clock_.handle_hit(page); }
+};
+
+/**
+ * S3-FIFO, as per: https://dl.acm.org/doi/10.1145/3600006.3613147
+ *
+ * Admitted pages enter a small FIFO queue (10% of the capacity, in the probationary
+ * slot), which quickly demotes pages that are not accessed again: when a page
+ * reaches the end of the small queue, it's moved to the main FIFO queue (in the
+ * eden slot) if it was hit in the meantime, and evicted otherwise. The keys of
+ * pages evicted from the small queue are remembered in a ghost queue for a while,
+ * and if such a key is admitted again, its page goes straight to the main queue.
+ * Pages reaching the end of the main queue are reinserted if they were hit since
+ * they were last (re)inserted, and evicted otherwise.
+ *
+ * The ghost queue holds hashes of the keys' std::hash mixed with a random
+ * per-instance seed, like the frequency sketch, so that which keys are mistaken
+ * for ghosts can't be predicted.
+ *
+ * Hits only increment a 2-bit counter, so they don't reorder the queues.
+ */
+template<typename Page>
+class s3fifo_policy
+{
+    using K = typename Page::key_type;
+    using cache_slot = detail::cache_slot;
+    using lru = lru_segment<Page>;
+
+    static constexpr int max_reference_count = 3;
+
+    lru small_;
+    lru main_;
+
+    // The hashes of the keys of recently evicted small queue pages, oldest first,
+    // along with how many times each hash is in the queue.
+    std::deque<uint32_t> ghost_;
+    std::unordered_map<uint32_t, int> ghost_counts_;
+    uint64_t ghost_seed_;
+
+public:
+    using page_position = typename lru::page_position;
+
+    explicit s3fifo_policy(int capacity)
+        : small_(0)
+        , main_(0)
+        , ghost_seed_(uint64_t(std::random_device()()) * 0x9e3779b97f4a7c15)
+    {
+        set_capacity(capacity);
+    }
+
+    int size() const noexcept { return small_.size() + main_.size(); }
+    int capacity() const noexcept { return small_.capacity() + main_.capacity(); }
+    bool is_full() const noexcept { return size() >= capacity(); }
+
+    void set_capacity(const int n)
+    {
+        small_.set_capacity(n > 0 ? std::max(1, n / 10) : 0);
+        main_.set_capacity(n - small_.capacity());
+        while(int(ghost_.size()) > main_.capacity()) { pop_ghost(); }
+    }
+
+    /**
+     * Moves the pages at the end of the queues that were hit to the main queue,
+     * until the page at the end of the queue that's over its share of the capacity
+     * (or of the only non-empty queue) was not hit, and returns that page.
+     */
+    page_position victim_pos() noexcept
+    {
+        while(true)
+        {
+            if(small_.size() > 0
+                && (small_.size() >= small_.capacity() || main_.size() == 0))
+            {
+                auto page = small_.lru_pos();
+                if(page->reference_count == 0) { return page; }
+                page->reference_count = 0;
+                main_.transfer_page_from(page, small_);
+                page->cache_slot = cache_slot::eden;
+            }
+            else
+            {
+                // Terminates, as each step decrements a reference count.
+                auto page = main_.lru_pos();
+                if(page->reference_count == 0) { return page; }
+                --page->reference_count;
+                main_.transfer_page_from(page, main_);
+            }
+        }
+    }
+
+    const K& victim_key() noexcept { return victim_pos()->key; }
+
+    // Hits don't move pages anyway.
+    void set_lazy_promotion(float) noexcept {}
+
+    const lru& eden() const noexcept { return main_; }
+    const lru& probationary() const noexcept { return small_; }
+
+    void evict()
+    {
+        auto page = victim_pos();
+        if(page->cache_slot == cache_slot::probationary) { push_ghost(page->key); }
+        erase(page);
+    }
+
+    void erase(page_position page)
+    {
+        if(page->cache_slot == cache_slot::eden)
+            main_.erase(page);
+        else
+            small_.erase(page);
+    }
+
+    void clear() noexcept
+    {
+        small_.clear();
+        main_.clear();
+        ghost_.clear();
+        ghost_counts_.clear();
+    }
+
+    template<typename... Args>
+    bool append(page_position& pos, const K& key, cache_slot slot, Args&&... args)
+    {
+        if(is_full()) { return false; }
+        if(slot == cache_slot::eden && !main_.is_full())
+            pos = main_.append(key, slot, std::forward<Args>(args)...);
+        else
+            pos = small_.append(key, cache_slot::probationary,
+                std::forward<Args>(args)...);
+        return true;
+    }
+
+    void transfer_page_from(page_position page, lru& source)
+    {
+        page->reference_count = 0;
+        auto it = ghost_counts_.find(ghost_hash(page->key));
+        if(it != ghost_counts_.end())
+        {
+            main_.transfer_page_from(page, source);
+            page->cache_slot = cache_slot::eden;
+        }
+        else
+        {
+            small_.transfer_page_from(page, source);
+            page->cache_slot = cache_slot::probationary;
+        }
+    }
+
+    void handle_hit(page_position page) noexcept
+    {
+        if(page->reference_count < max_reference_count) { ++page->reference_count; }
+    }
+
+private:
+    void push_ghost(const K& key)
+    {
+        if(main_.capacity() <= 0) { return; }
+        if(int(ghost_.size()) >= main_.capacity()) { pop_ghost(); }
+        const uint32_t hash = ghost_hash(key);
+        ghost_.push_back(hash);
+        ++ghost_counts_[hash];
+    }
+
+    uint32_t ghost_hash(const K& key) const
+    {
+        return detail::fold_hash(std::hash<K>()(key) ^ std::size_t(ghost_seed_));
+    }
+
+    void pop_ghost()
+    {
+        auto it = ghost_counts_.find(ghost_.front());
+        if(--it->second == 0) { ghost_counts_.erase(it); }
+        ghost_.pop_front();
+    }
+};
+
+#endif
@@ -21,12 +21,20 @@
 #ifndef FREQUENCY_SKETCH_HEADER
 #define FREQUENCY_SKETCH_HEADER
 
+#include "snapshot.hpp"
 #include "detail.hpp"
 
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
 #include <stdexcept>
 #include <limits>
+#include <random>
+#include <algorithm>
+#include <functional>
 
 /**
  * A probabilistic set for estimating the popularity (frequency) of an element within an
@@ -41,6 +49,10 @@
  *
  * The white paper:
  * http://dimacs.rutgers.edu/~graham/pubs/papers/cm-full.pdf
+ *
+ * Items are hashed with std::hash, whose result is mixed with a random per-instance
+ * seed, so that an adversary can't craft keys that collide with (and thus inflate
+ * the frequency of) other keys, unless their std::hash values are equal.
  */
 template<typename T>
 class frequency_sketch
@@ -52,22 +64,89 @@ class frequency_sketch
 
     // Incremented with each call to record_access, if the frequency of the item could
     // be incremented, and halved when sampling size is reached.
-    int size_;
+    int size_ = 0;
+
+    uint32_t hash_seed_;
+
+    /**
+     * The header of the sketch's persisted form. It's padded to a cache line so that
+     * the table following it is suitably aligned when the file is memory mapped.
+     */
+    struct file_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t table_size;
+        uint64_t size;
+        // Zero in version 1 files, which were written by unseeded sketches.
+        uint32_t hash_seed;
+        // Versions 1 and 2 located counters by a hash of the items' bytes rather
+        // than by their std::hash, so their counters are discarded when loaded.
+        uint8_t padding[36];
+    };
+    static_assert(sizeof(file_header) == 64, "file_header must be 64 bytes");
+
+    // "WTFS" when read as a little endian integer.
+    static constexpr uint32_t file_magic = 0x53465457;
+    static constexpr uint32_t file_version = 3;
 
 public:
-    explicit frequency_sketch(int capacity)
+    /**
+     * $hash_seed should only be given to reproduce the behavior of another sketch
+     * (or for testing); by default it's random.
+     */
+    explicit frequency_sketch(int capacity, uint32_t hash_seed = random_seed())
+        : hash_seed_(hash_seed)
     {
         change_capacity(capacity);
     }
 
+    uint32_t hash_seed() const noexcept { return hash_seed_; }
+
+    /**
+     * Resizes the sketch while preserving the recorded frequencies.
+     *
+     * Since an item's counters are located by masking its hash with the table size,
+     * when the table shrinks (by a factor of 2^k), the blocks whose indices are equal
+     * modulo the new size are folded into one by taking the maximum of each pair of
+     * counters, which never underestimates a frequency. When the table grows, each
+     * block is copied to all the indices it may map to under the new size, which
+     * preserves every estimate exactly and requires no rehashing.
+     */
     void change_capacity(const int n)
     {
         if(n <= 0)
         {
             throw std::invalid_argument("frequency_sketch capacity must be larger than 0");
         }
-        table_.resize(detail::nearest_power_of_two(n));
-        size_ = 0;
+
+        const std::size_t new_size = detail::nearest_power_of_two(n);
+        const std::size_t old_size = table_.size();
+        if(old_size == 0 || new_size == old_size)
+        {
+            table_.resize(new_size);
+            return;
+        }
+
+        if(new_size < old_size)
+        {
+            for(auto i = new_size; i < old_size; ++i)
+            {
+                auto& block = table_[i & (new_size - 1)];
+                block = max_counters(block, table_[i]);
+            }
+            table_.resize(new_size);
+        }
+        else
+        {
+            table_.resize(new_size);
+            for(auto i = old_size; i < new_size; ++i)
+            {
+                table_[i] = table_[i & (old_size - 1)];
+            }
+        }
+
+        if(size_ >= sampling_size()) { reset(); }
     }
 
     bool contains(const T& t) const noexcept
@@ -75,9 +154,76 @@ public:
         return frequency(t) > 0;
     }
 
+    /**
+     * Writes the sketch to $out as a 64 byte header followed by the raw counter
+     * table, so that the file can be read back with load (or memory mapped).
+     */
+    void save(std::ostream& out) const
+    {
+        file_header header{};
+        header.magic = file_magic;
+        header.version = file_version;
+        header.table_size = table_.size();
+        header.size = size_;
+        header.hash_seed = hash_seed_;
+        snapshot::write_pod(out, header);
+        out.write(reinterpret_cast<const char*>(table_.data()),
+            table_.size() * sizeof(uint64_t));
+        if(!out) { throw std::runtime_error("could not write frequency_sketch"); }
+    }
+
+    /**
+     * Replaces the sketch's contents with those written by save. The sketch takes on
+     * the capacity and the hash seed of the saved sketch (as the saved counters are
+     * located by the hashes it computed).
+     */
+    void load(std::istream& in)
+    {
+        const auto header = snapshot::read_pod<file_header>(in);
+        validate(header);
+
+        std::vector<uint64_t> table(header.table_size);
+        if(!in.read(reinterpret_cast<char*>(table.data()),
+            table.size() * sizeof(uint64_t)))
+        {
+            throw std::runtime_error("unexpected end of frequency_sketch");
+        }
+        table_ = std::move(table);
+        size_ = std::min<uint64_t>(header.size, sampling_size() - 1);
+        hash_seed_ = header.hash_seed;
+        if(header.version < 3) { discard_counters(); }
+    }
+
+    /**
+     * Same as the stream overload, but reads the sketch from the $size bytes at
+     * $data, e.g. a memory mapped file. Returns the number of bytes read.
+     */
+    std::size_t load(const char* data, const std::size_t size)
+    {
+        file_header header;
+        if(size < sizeof header)
+        {
+            throw std::runtime_error("unexpected end of frequency_sketch");
+        }
+        std::memcpy(&header, data, sizeof header);
+        validate(header);
+
+        const std::size_t table_bytes = header.table_size * sizeof(uint64_t);
+        if(size - sizeof header < table_bytes)
+        {
+            throw std::runtime_error("unexpected end of frequency_sketch");
+        }
+        table_.resize(header.table_size);
+        std::memcpy(table_.data(), data + sizeof header, table_bytes);
+        size_ = std::min<uint64_t>(header.size, sampling_size() - 1);
+        hash_seed_ = header.hash_seed;
+        if(header.version < 3) { discard_counters(); }
+        return sizeof header + table_bytes;
+    }
+
     int frequency(const T& t) const noexcept
     {
-        const uint32_t hash = detail::hash(t);
+        const uint32_t hash = this->hash(t);
         int frequency = std::numeric_limits<int>::max();
 
         for(auto i = 0; i < 4; ++i)
@@ -88,9 +234,57 @@ public:
         return frequency;
     }
 
+    /** Returns the hash by which $t's counters are located in the sketch. */
+    uint32_t hash(const T& t) const noexcept
+    {
+        return hash_of(std::hash<T>()(t));
+    }
+
+    /**
+     * Same as hash, but computed from $key_hash, the item's std::hash, so that a
+     * caller that also needs the std::hash for something else computes it only once.
+     */
+    uint32_t hash_of(const std::size_t key_hash) const noexcept
+    {
+        // std::hash is often the identity for integers, so the seed is mixed in
+        // before the bits are spread.
+        return uint32_t(detail::mix64(uint64_t(key_hash) ^ seed_mask()) >> 32);
+    }
+
+    /**
+     * Prefetches the blocks holding the counters of the item with $hash, so that a
+     * subsequent record_access_by_hash doesn't stall on memory.
+     */
+    void prefetch(const uint32_t hash) const noexcept
+    {
+        for(auto i = 0; i < 4; ++i)
+        {
+            detail::prefetch(&table_[table_index(hash, i)]);
+        }
+    }
+
     void record_access(const T& t) noexcept
     {
-        const uint32_t hash = detail::hash(t);
+        record_access_by_hash(hash(t));
+    }
+
+    /**
+     * Records accesses of $t until its estimated frequency reaches $frequency (or
+     * the maximum of 15), e.g. to restore the popularity of an item remembered from
+     * a previous run.
+     */
+    void seed(const T& t, const int frequency) noexcept
+    {
+        const uint32_t hash = this->hash(t);
+        for(auto f = this->frequency(t); f < std::min(frequency, 15); ++f)
+        {
+            record_access_by_hash(hash);
+        }
+    }
+
+    /** Same as record_access, but with the item's hash already computed. */
+    void record_access_by_hash(const uint32_t hash) noexcept
+    {
         bool was_added = false;
 
         for(auto i = 0; i < 4; ++i)
@@ -105,6 +299,38 @@ public:
     }
 
 private:
+    static void validate(const file_header& header)
+    {
+        if(header.magic != file_magic || header.version == 0
+            || header.version > file_version)
+        {
+            throw std::runtime_error("not a frequency_sketch file");
+        }
+        if(header.table_size == 0
+           || header.table_size > uint64_t(std::numeric_limits<int>::max() / 10)
+           || header.table_size != detail::nearest_power_of_two(header.table_size))
+        {
+            throw std::runtime_error("invalid frequency_sketch table size");
+        }
+    }
+
+    static uint32_t random_seed()
+    {
+        return std::random_device()();
+    }
+
+    /** Spreads the 32 bit seed over the 64 bits of a std::hash. */
+    uint64_t seed_mask() const noexcept
+    {
+        return uint64_t(hash_seed_) * 0x9e3779b97f4a7c15;
+    }
+
+    void discard_counters() noexcept
+    {
+        std::fill(table_.begin(), table_.end(), 0);
+        size_ = 0;
+    }
+
     int get_count(const uint32_t hash, const int counter_index) const noexcept
     {
         const int table_index = this->table_index(hash, counter_index);
@@ -175,6 +401,17 @@ private:
         return (hash & 3) << 2;
     }
 
+    /** Returns the counter-wise maximum of two blocks. */
+    static uint64_t max_counters(const uint64_t a, const uint64_t b) noexcept
+    {
+        uint64_t result = 0;
+        for(auto offset = 0; offset < 64; offset += 4)
+        {
+            result |= std::max((a >> offset) & 0xf, (b >> offset) & 0xf) << offset;
+        }
+        return result;
+    }
+
     /** Returns true if the counter has not reached the limit of 15. */
     bool can_increment_counter_at(const int table_index, const int offset) const noexcept
     {
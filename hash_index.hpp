@@ -0,0 +1,269 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef HASH_INDEX_HEADER
+#define HASH_INDEX_HEADER
+
+#include "detail.hpp"
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
+/**
+ * An open addressing (linear probing) hash table of values of type $T that are
+ * looked up by a key of type $K, which $KeyOf extracts from a value. Since the key
+ * is not stored separately, the index may refer to values that are stored elsewhere
+ * (e.g. list positions of cache pages that hold the key) without copying the key.
+ *
+ * Along with each value, a 16 bit fingerprint of its key's hash is stored in a
+ * separate array, and the key of a value is only compared against the sought key
+ * if their fingerprints match. Thus the probe of a key that is not in the index
+ * almost never touches the values (nor, through them, the keys), which makes
+ * lookups of large keys and misses cheap, while full key comparison guarantees that
+ * hash collisions never yield a wrong value.
+ *
+ * Erased slots are marked with a tombstone, which are purged when the table is
+ * rehashed. Inserting may rehash the table, which invalidates the pointers returned
+ * by find.
+ *
+ * Rehashing moves all values at once, so the insertion that triggers it takes time
+ * linear in the table size. It happens when the index grows past its load factor,
+ * which sizing the index for its maximum size up front avoids, and when tombstones
+ * fill the table. With a table sized for $n values, the latter only happens after at
+ * least $n erasures, so it's amortized constant time, but the pause is there.
+ *
+ * A key's hash may be computed once with key_hash and passed to prefetch and find,
+ * e.g. to reuse it for other purposes.
+ */
+template<
+    typename K,
+    typename T,
+    typename KeyOf,
+    typename Hash = std::hash<K>,
+    typename KeyEqual = std::equal_to<K>
+> class hash_index
+{
+    // Fingerprints are never one of these values.
+    static constexpr uint16_t empty_tag = 0;
+    static constexpr uint16_t erased_tag = 1;
+
+    // The table is rehashed when this fraction of its slots are taken (including by
+    // tombstones).
+    static constexpr int max_load_percent = 75;
+
+    // Returned by find_slot if the key is not in the index.
+    static constexpr std::size_t no_slot = std::size_t(-1);
+
+    std::vector<uint16_t> tags_;
+    std::vector<T> values_;
+    int size_ = 0;
+    int num_erased_ = 0;
+
+    KeyOf key_of_;
+    Hash hash_;
+    KeyEqual key_equal_;
+
+public:
+    /**
+     * $key_of may be given if $KeyOf has state, e.g. a pointer to where the values
+     * point into.
+     */
+    explicit hash_index(const int capacity = 0, KeyOf key_of = KeyOf())
+        : key_of_(std::move(key_of))
+    {
+        rehash(table_size_for(capacity));
+    }
+
+    int size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    /** Returns the number of slots in the table. */
+    std::size_t table_size() const noexcept { return tags_.size(); }
+
+    /** Returns the hash of $key as computed by $Hash. */
+    std::size_t key_hash(const K& key) const
+    {
+        return hash_(key);
+    }
+
+    /** Returns the value whose key is $key, or null if there's none. */
+    T* find(const K& key)
+    {
+        return find(key, key_hash(key));
+    }
+
+    const T* find(const K& key) const
+    {
+        return find(key, key_hash(key));
+    }
+
+    /** Same as find, but with $key's hash already computed by key_hash. */
+    T* find(const K& key, const std::size_t key_hash)
+    {
+        const std::size_t slot = find_slot(key, mix(key_hash));
+        return slot != no_slot ? &values_[slot] : nullptr;
+    }
+
+    const T* find(const K& key, const std::size_t key_hash) const
+    {
+        const std::size_t slot = find_slot(key, mix(key_hash));
+        return slot != no_slot ? &values_[slot] : nullptr;
+    }
+
+    /** Inserts $value, whose key must not be in the index yet. */
+    void insert(T value)
+    {
+        // In 64 bits, as the products overflow an int for tables of 2^25 slots.
+        if((uint64_t(size_) + num_erased_ + 1) * 100
+            > uint64_t(tags_.size()) * max_load_percent)
+        {
+            rehash(table_size_for(size_ + 1));
+        }
+        const uint64_t hash = this->hash(key_of_(value));
+        const std::size_t slot = free_slot(hash);
+        if(tags_[slot] == erased_tag) { --num_erased_; }
+        tags_[slot] = fingerprint(hash);
+        values_[slot] = std::move(value);
+        ++size_;
+    }
+
+    /** Erases the value whose key is $key. Returns false if there's none. */
+    bool erase(const K& key)
+    {
+        const std::size_t slot = find_slot(key, hash(key));
+        if(slot == no_slot) { return false; }
+        tags_[slot] = erased_tag;
+        values_[slot] = T();
+        --size_;
+        ++num_erased_;
+        return true;
+    }
+
+    /** Erases all values, but keeps the table's size. */
+    void clear()
+    {
+        std::fill(tags_.begin(), tags_.end(), uint16_t(empty_tag));
+        std::fill(values_.begin(), values_.end(), T());
+        size_ = 0;
+        num_erased_ = 0;
+    }
+
+    /** Calls $f with each value, in no particular order. */
+    template<typename Function>
+    void for_each(Function f)
+    {
+        for(std::size_t slot = 0; slot < tags_.size(); ++slot)
+        {
+            if(tags_[slot] > erased_tag) { f(values_[slot]); }
+        }
+    }
+
+    /**
+     * Hints the CPU to start loading the slot where the probe of the key with
+     * $key_hash (see key_hash) begins.
+     */
+    void prefetch(const std::size_t key_hash) const noexcept
+    {
+        detail::prefetch(&tags_[home_slot(mix(key_hash))]);
+    }
+
+private:
+    uint64_t hash(const K& key) const
+    {
+        return mix(key_hash(key));
+    }
+
+    static uint64_t mix(const std::size_t key_hash) noexcept
+    {
+        // std::hash is often the identity for integers, so spread its bits.
+        return detail::mix64(uint64_t(key_hash));
+    }
+
+    std::size_t home_slot(const uint64_t hash) const noexcept
+    {
+        return hash & (tags_.size() - 1);
+    }
+
+    /** The fingerprint is taken from the high bits, the slot from the low bits. */
+    static uint16_t fingerprint(const uint64_t hash) noexcept
+    {
+        const uint16_t tag = hash >> 48;
+        return tag > erased_tag ? tag : tag + 2;
+    }
+
+    std::size_t find_slot(const K& key, const uint64_t hash) const
+    {
+        const uint16_t tag = fingerprint(hash);
+        const std::size_t mask = tags_.size() - 1;
+        // Terminates since the table always has empty slots (see max_load_percent).
+        for(std::size_t slot = home_slot(hash); tags_[slot] != empty_tag;
+            slot = (slot + 1) & mask)
+        {
+            if(tags_[slot] == tag && key_equal_(key_of_(values_[slot]), key))
+            {
+                return slot;
+            }
+        }
+        return no_slot;
+    }
+
+    /** Returns the first empty or erased slot on the probe sequence of $hash. */
+    std::size_t free_slot(const uint64_t hash) const noexcept
+    {
+        const std::size_t mask = tags_.size() - 1;
+        std::size_t slot = home_slot(hash);
+        while(tags_[slot] > erased_tag) { slot = (slot + 1) & mask; }
+        return slot;
+    }
+
+    /** Returns the table size (a power of two) that keeps $n values under the load. */
+    static std::size_t table_size_for(const int n) noexcept
+    {
+        // In 64 bits, as n * 100 overflows an int for n over about 21 million.
+        const uint64_t min_size = std::max<uint64_t>(8,
+            (uint64_t(n) * 100 + max_load_percent - 1) / max_load_percent * 2);
+        std::size_t table_size = 8;
+        while(table_size < min_size) { table_size *= 2; }
+        return table_size;
+    }
+
+    void rehash(const std::size_t table_size)
+    {
+        std::vector<uint16_t> tags(table_size, uint16_t(empty_tag));
+        std::vector<T> values(table_size);
+        tags.swap(tags_);
+        values.swap(values_);
+        num_erased_ = 0;
+
+        for(std::size_t slot = 0; slot < tags.size(); ++slot)
+        {
+            if(tags[slot] <= erased_tag) { continue; }
+            const std::size_t new_slot = free_slot(hash(key_of_(values[slot])));
+            tags_[new_slot] = tags[slot];
+            values_[new_slot] = std::move(values[slot]);
+        }
+    }
+};
+
+#endif
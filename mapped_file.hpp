@@ -0,0 +1,105 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef MAPPED_FILE_HEADER
+#define MAPPED_FILE_HEADER
+
+#if defined(__unix__) || defined(__APPLE__)
+# define WTINYLFU_HAS_MMAP 1
+#endif
+
+#ifdef WTINYLFU_HAS_MMAP
+
+#include <string>
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Maps an entire file into memory. The mapping is private and writable, so the file's
+ * pages are only read from disk when first touched and are copied only if written to,
+ * and writes to the mapping are not carried through to the file.
+ *
+ * NOTE: the file must not be truncated or rewritten in place while it's mapped:
+ * touching a page past the file's new end raises SIGBUS, and pages not yet copied
+ * may show the new contents. Replace it by renaming another file over it instead
+ * (which leaves the mapped file intact until it's unmapped).
+ */
+class mapped_file
+{
+    void* data_ = nullptr;
+    std::size_t size_ = 0;
+
+public:
+    explicit mapped_file(const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd == -1) { throw_last_error("could not open " + path); }
+
+        struct stat status;
+        if(::fstat(fd, &status) == -1)
+        {
+            ::close(fd);
+            throw_last_error("could not stat " + path);
+        }
+        size_ = status.st_size;
+
+        if(size_ > 0)
+        {
+            data_ = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if(data_ == MAP_FAILED)
+            {
+                data_ = nullptr;
+                ::close(fd);
+                throw_last_error("could not map " + path);
+            }
+        }
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+        if(data_) { ::munmap(data_, size_); }
+    }
+
+    char* data() noexcept { return static_cast<char*>(data_); }
+    const char* data() const noexcept { return static_cast<const char*>(data_); }
+    std::size_t size() const noexcept { return size_; }
+
+private:
+    static void throw_last_error(const std::string& what)
+    {
+        throw std::system_error(errno, std::system_category(), what);
+    }
+};
+
+#endif // WTINYLFU_HAS_MMAP
+
+#endif
@@ -0,0 +1,237 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef MISS_RATIO_CURVE_HEADER
+#define MISS_RATIO_CURVE_HEADER
+
+#include "detail.hpp"
+
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * Estimates the miss ratio curve (MRC) of an access stream, i.e. the miss ratio the
+ * stream would have at each cache capacity, with the SHARDS algorithm:
+ * https://www.usenix.org/system/files/conference/fast15/fast15-paper-waldspurger.pdf
+ *
+ * Only the accesses of keys whose (re)hashed value falls under a threshold are
+ * sampled. For these, the exact reuse distance (the number of distinct sampled keys
+ * accessed since the key's last access) is computed and, scaled up by the inverse
+ * of the sampling rate, added to a histogram from which the curve is derived.
+ *
+ * Memory is bounded by tracking at most $max_sampled_keys keys: once exceeded, the
+ * key with the largest hash is dropped and the threshold lowered to it, i.e. the
+ * sampling rate adapts to the number of distinct keys (fixed-size SHARDS).
+ *
+ * NOTE: the reuse distance based MRC is that of an LRU cache, so it approximates,
+ * rather than predicts, the curve of a W-TinyLFU cache, whose hit ratio is at least
+ * as good for most workloads.
+ */
+class miss_ratio_curve_estimator
+{
+public:
+    struct options
+    {
+        // The upper bound on the number of tracked keys, which bounds memory use.
+        int max_sampled_keys = 8192;
+
+        // The fraction of keys sampled until $max_sampled_keys is reached.
+        double initial_sampling_rate = 0.01;
+
+        // The curve is reported at multiples of $bucket_size cache entries, up to
+        // $num_buckets * $bucket_size entries.
+        int bucket_size = 100;
+        int num_buckets = 1000;
+    };
+
+private:
+    options options_;
+
+    // Accesses of keys with a hash below this are sampled.
+    uint64_t threshold_;
+
+    // Maps the hashes of sampled keys to the time of their last access. Time is
+    // measured in sampled accesses.
+    std::map<uint32_t, uint64_t> last_access_;
+
+    // A Fenwick tree over time in which a time is marked if it's the last access
+    // time of some key, used to count the distinct keys accessed since some time.
+    std::vector<int> marks_;
+    uint64_t now_ = 0;
+
+    // The (scaled) number of sampled accesses per reuse distance bucket. The last
+    // bucket holds distances beyond the last bucket's and cold misses.
+    std::vector<double> histogram_;
+    double num_sampled_accesses_ = 0;
+    uint64_t num_accesses_ = 0;
+
+public:
+    miss_ratio_curve_estimator() : miss_ratio_curve_estimator(options()) {}
+
+    explicit miss_ratio_curve_estimator(options opts)
+        : options_(opts)
+        , histogram_(std::max(opts.num_buckets, 1) + 1)
+    {
+        if(opts.max_sampled_keys <= 0 || opts.bucket_size <= 0 || opts.num_buckets <= 0)
+        {
+            throw std::invalid_argument("invalid miss ratio curve estimator options");
+        }
+        if(opts.initial_sampling_rate <= 0 || opts.initial_sampling_rate > 1)
+        {
+            throw std::invalid_argument("sampling rate must be in (0, 1]");
+        }
+        threshold_ = uint64_t(opts.initial_sampling_rate * (uint64_t(1) << 32));
+        marks_.resize(4 * std::size_t(opts.max_sampled_keys) + 1);
+    }
+
+    /** Returns the current fraction of keys that are sampled. */
+    double sampling_rate() const noexcept
+    {
+        return double(threshold_) / double(uint64_t(1) << 32);
+    }
+
+    uint64_t num_accesses() const noexcept { return num_accesses_; }
+
+    /** Records an access of the key with $key_hash. */
+    void record_access(const uint32_t key_hash)
+    {
+        ++num_accesses_;
+        const uint32_t hash = detail::mix(key_hash);
+        if(hash >= threshold_) { return; }
+
+        if(now_ + 1 == marks_.size()) { compact(); }
+        const uint64_t now = ++now_;
+
+        auto it = last_access_.find(hash);
+        if(it != last_access_.end())
+        {
+            const uint64_t distance = count_marks(now - 1) - count_marks(it->second);
+            add_mark(it->second, -1);
+            it->second = now;
+            add_to_histogram(bucket_of(distance / sampling_rate()));
+        }
+        else
+        {
+            last_access_.emplace(hash, now);
+            add_to_histogram(histogram_.size() - 1);
+            if(int(last_access_.size()) > options_.max_sampled_keys)
+            {
+                lower_threshold();
+            }
+        }
+        add_mark(now, +1);
+    }
+
+    /**
+     * Returns the estimated miss ratio at each multiple of the bucket size as
+     * (capacity, miss ratio) pairs, in order of increasing capacity. Empty if no
+     * accesses have been sampled yet.
+     */
+    std::vector<std::pair<int, double>> curve() const
+    {
+        std::vector<std::pair<int, double>> curve;
+        if(num_sampled_accesses_ <= 0) { return curve; }
+
+        // Per SHARDS-adj, account for the difference between the expected and the
+        // actual number of sampled accesses in the smallest distance bucket.
+        const double expected = num_accesses_ * sampling_rate();
+        const double total = std::max(expected, num_sampled_accesses_);
+        double num_hits = expected - num_sampled_accesses_;
+        for(std::size_t i = 0; i + 1 < histogram_.size(); ++i)
+        {
+            num_hits += histogram_[i];
+            const double miss_ratio = 1.0 - std::max(num_hits, 0.0) / total;
+            curve.emplace_back((i + 1) * options_.bucket_size,
+                std::min(std::max(miss_ratio, 0.0), 1.0));
+        }
+        return curve;
+    }
+
+private:
+    std::size_t bucket_of(const double distance) const noexcept
+    {
+        // A reuse distance of d is a hit in any cache with more than d entries.
+        const double bucket = distance / options_.bucket_size;
+        return std::min<double>(bucket, histogram_.size() - 1);
+    }
+
+    void add_to_histogram(const std::size_t bucket)
+    {
+        histogram_[bucket] += 1;
+        num_sampled_accesses_ += 1;
+    }
+
+    /**
+     * Drops the sampled key with the largest hash and lowers the threshold to that
+     * hash, rescaling the histogram to the new sampling rate.
+     */
+    void lower_threshold()
+    {
+        const double old_rate = sampling_rate();
+        auto largest = std::prev(last_access_.end());
+        threshold_ = largest->first;
+        add_mark(largest->second, -1);
+        last_access_.erase(largest);
+
+        const double scale = sampling_rate() / old_rate;
+        for(auto& count : histogram_) { count *= scale; }
+        num_sampled_accesses_ *= scale;
+    }
+
+    /** Renumbers last access times to 1..n so that time fits the Fenwick tree. */
+    void compact()
+    {
+        std::vector<std::pair<uint64_t, uint32_t>> by_time;
+        by_time.reserve(last_access_.size());
+        for(const auto& entry : last_access_)
+        {
+            by_time.emplace_back(entry.second, entry.first);
+        }
+        std::sort(by_time.begin(), by_time.end());
+
+        std::fill(marks_.begin(), marks_.end(), 0);
+        now_ = 0;
+        for(const auto& entry : by_time)
+        {
+            last_access_[entry.second] = ++now_;
+            add_mark(now_, +1);
+        }
+    }
+
+    void add_mark(uint64_t time, const int delta) noexcept
+    {
+        for(; time < marks_.size(); time += time & -time) { marks_[time] += delta; }
+    }
+
+    /** Returns the number of marks at times [1, $time]. */
+    uint64_t count_marks(uint64_t time) const noexcept
+    {
+        uint64_t count = 0;
+        for(; time > 0; time -= time & -time) { count += marks_[time]; }
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,129 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef REMOVAL_DELIVERER_HEADER
+#define REMOVAL_DELIVERER_HEADER
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <stdexcept>
+#include <condition_variable>
+
+/**
+ * Delivers the removal notifications of a cache (see
+ * wtinylfu_cache::set_removal_listener) on a background thread.
+ *
+ * $listener is installed with batched delivery, so evictions only queue the
+ * notifications, and every $interval the queued ones are taken from the cache and
+ * handed to $listener, without the cache's lock held (so it may call back into the
+ * cache). This bounds how long removed values are kept alive by the queue. When the
+ * deliverer is destroyed, the listener is unset and the remaining notifications are
+ * delivered on the destroying thread.
+ *
+ * The listener is called from one thread at a time and must not throw.
+ *
+ * $Cache is meant to be synchronized_wtinylfu_cache.
+ */
+template<typename Cache>
+class removal_deliverer
+{
+public:
+    using removal_listener = typename Cache::removal_listener;
+
+    struct options
+    {
+        std::chrono::milliseconds interval = std::chrono::milliseconds(100);
+    };
+
+private:
+    Cache& cache_;
+    options options_;
+    removal_listener listener_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool is_stopped_ = false;
+    std::thread thread_;
+
+public:
+    removal_deliverer(Cache& cache, removal_listener listener, options opts)
+        : cache_(cache)
+        , options_(opts)
+        , listener_(std::move(listener))
+    {
+        if(options_.interval.count() <= 0)
+        {
+            throw std::invalid_argument("interval must be greater than zero");
+        }
+        if(!listener_)
+        {
+            throw std::invalid_argument("listener must not be empty");
+        }
+        cache_.set_removal_listener(listener_, Cache::removal_delivery::batched);
+        thread_ = std::thread([this] { run(); });
+    }
+
+    removal_deliverer(Cache& cache, removal_listener listener)
+        : removal_deliverer(cache, std::move(listener), options())
+    {}
+
+    removal_deliverer(const removal_deliverer&) = delete;
+    removal_deliverer& operator=(const removal_deliverer&) = delete;
+
+    /**
+     * Stops the thread and unsets the cache's listener, then delivers the remaining
+     * notifications.
+     */
+    ~removal_deliverer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopped_ = true;
+        }
+        cond_.notify_one();
+        thread_.join();
+        cache_.set_removal_listener(removal_listener());
+        deliver();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(!cond_.wait_for(lock, options_.interval, [this] { return is_stopped_; }))
+        {
+            lock.unlock();
+            deliver();
+            lock.lock();
+        }
+    }
+
+    void deliver()
+    {
+        for(auto& n : cache_.take_removal_notifications())
+        {
+            listener_(n.key, std::move(n.value), n.cause);
+        }
+    }
+};
+
+#endif
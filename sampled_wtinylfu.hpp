@@ -0,0 +1,376 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef SAMPLED_WTINYLFU_HEADER
+#define SAMPLED_WTINYLFU_HEADER
+
+#include "frequency_sketch.hpp"
+#include "hash_index.hpp"
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+/**
+ * A variant of wtinylfu_cache whose segments are flat arrays of entries rather than
+ * linked lists, as in Redis and Ristretto. Instead of being ordered, victims are
+ * picked by sampling $sample_size random entries of a segment:
+ *
+ * - the window's victim is the least recently used of the sampled window entries
+ *   (each entry is stamped with the time of its last access);
+ * - the main cache's victim is the sampled main entry with the lowest estimated
+ *   access frequency in the frequency sketch.
+ *
+ * TinyLFU admission works as in wtinylfu_cache: when the cache is full, the window's
+ * victim replaces the main cache's victim only if it's accessed more frequently.
+ *
+ * This saves the two list pointers and the heap allocation per entry, and a hit
+ * only updates the entry's timestamp instead of moving it in a list, at the cost
+ * of a slightly lower hit ratio (which improves with larger samples, at the cost of
+ * slower evictions).
+ *
+ * Entries are looked up by key in a hash_index whose slots hold the segment and
+ * position of an entry, and which compares keys through them, so each key is
+ * stored only once, in its entry. Keys must thus be hashable with std::hash and
+ * comparable with ==.
+ *
+ * NOTE: it is NOT thread-safe!
+ */
+template<
+    typename K,
+    typename V
+> class sampled_wtinylfu_cache
+{
+    // The segment and the position within the segment of an entry.
+    struct location
+    {
+        bool is_main;
+        int index;
+    };
+
+    struct entry
+    {
+        K key;
+        std::shared_ptr<V> data;
+        // The value of $clock_ when the entry was last accessed.
+        uint32_t last_access;
+    };
+
+    struct entry_key
+    {
+        const sampled_wtinylfu_cache* cache = nullptr;
+
+        const K& operator()(const location loc) const noexcept
+        {
+            return (loc.is_main ? cache->main_ : cache->window_)[loc.index].key;
+        }
+    };
+
+    float window_ratio_;
+    int sample_size_;
+
+    frequency_sketch<K> filter_;
+
+    // Maps keys to the locations of their entries. The keys are compared through the
+    // locations, so an entry must be in place before it's inserted into the index
+    // and must be erased from the index before it's removed, and the index must be
+    // updated before an entry is moved.
+    hash_index<K, location, entry_key> index_;
+
+    std::vector<entry> window_;
+    std::vector<entry> main_;
+    int window_capacity_;
+    int main_capacity_;
+
+    // Incremented on each access, so that entry ages can be compared. Ages are
+    // computed with wrapping arithmetic, so overflow is harmless.
+    uint32_t clock_ = 0;
+
+    std::minstd_rand rng_;
+
+    // Statistics.
+    int num_cache_hits_ = 0;
+    int num_cache_misses_ = 0;
+
+public:
+    /**
+     * $window_ratio is the fraction of $capacity allocated to the window cache (see
+     * wtinylfu_cache). $sample_size is the number of entries sampled to pick a victim;
+     * Redis defaults to 5.
+     */
+    explicit sampled_wtinylfu_cache(int capacity, float window_ratio = 0.01f,
+        int sample_size = 5)
+        : window_ratio_(window_ratio)
+        , sample_size_(sample_size)
+        , filter_(capacity)
+        , index_(capacity, entry_key{this})
+    {
+        if(window_ratio <= 0 || window_ratio >= 1)
+        {
+            throw std::invalid_argument("window ratio must be in (0, 1)");
+        }
+        if(sample_size <= 0)
+        {
+            throw std::invalid_argument("sample size must be greater than zero");
+        }
+        set_capacity(capacity);
+    }
+
+    // The index refers to this cache's arrays.
+    sampled_wtinylfu_cache(const sampled_wtinylfu_cache&) = delete;
+    sampled_wtinylfu_cache& operator=(const sampled_wtinylfu_cache&) = delete;
+
+    int size() const noexcept
+    {
+        return window_.size() + main_.size();
+    }
+
+    int capacity() const noexcept
+    {
+        return window_capacity_ + main_capacity_;
+    }
+
+    int num_cache_hits() const noexcept { return num_cache_hits_; }
+    int num_cache_misses() const noexcept { return num_cache_misses_; }
+
+    bool contains(const K& key) const noexcept
+    {
+        return index_.find(key) != nullptr;
+    }
+
+    void change_capacity(const int n)
+    {
+        if(n <= 0)
+        {
+            throw std::invalid_argument("cache capacity must be greater than zero");
+        }
+
+        filter_.change_capacity(n);
+        set_capacity(n);
+
+        // Only evict what is over the new capacity, so that an empty segment (the
+        // main cache has no room at all with a capacity of 1) is never sampled.
+        while(int(window_.size()) > window_capacity_) { evict(window_, window_victim()); }
+        while(int(main_.size()) > main_capacity_) { evict(main_, main_victim()); }
+    }
+
+    std::shared_ptr<V> get(const K& key)
+    {
+        const std::size_t key_hash = index_.key_hash(key);
+        filter_.record_access_by_hash(filter_.hash_of(key_hash));
+        auto loc = index_.find(key, key_hash);
+        if(loc != nullptr)
+        {
+            ++num_cache_hits_;
+            entry& e = segment(*loc)[loc->index];
+            e.last_access = ++clock_;
+            return e.data;
+        }
+        ++num_cache_misses_;
+        return nullptr;
+    }
+
+    std::shared_ptr<V> operator[](const K& key)
+    {
+        return get(key);
+    }
+
+    /**
+     * Returns the value of $key, or null if it's not cached, without recording an
+     * access or updating the statistics.
+     */
+    std::shared_ptr<V> peek(const K& key) const
+    {
+        auto loc = index_.find(key);
+        if(loc != nullptr)
+        {
+            const auto& s = loc->is_main ? main_ : window_;
+            return s[loc->index].data;
+        }
+        return nullptr;
+    }
+
+    template<typename ValueLoader>
+    std::shared_ptr<V> get_and_insert_if_missing(const K& key, ValueLoader value_loader)
+    {
+        std::shared_ptr<V> value = get(key);
+        if(value == nullptr)
+        {
+            value = std::make_shared<V>(value_loader(key));
+            insert(key, value);
+        }
+        return value;
+    }
+
+    void insert(K key, V value)
+    {
+        insert(std::move(key), std::make_shared<V>(std::move(value)));
+    }
+
+    void erase(const K& key)
+    {
+        auto loc = index_.find(key);
+        if(loc != nullptr)
+        {
+            evict(segment(*loc), loc->index);
+        }
+    }
+
+    /** Removes all entries, but keeps the frequency sketch and the statistics. */
+    void clear()
+    {
+        window_.clear();
+        main_.clear();
+        index_.clear();
+    }
+
+private:
+    void set_capacity(const int n)
+    {
+        window_capacity_ = std::max(1, int(std::ceil(window_ratio_ * n)));
+        main_capacity_ = n - window_capacity_;
+    }
+
+    std::vector<entry>& segment(const location loc) noexcept
+    {
+        return loc.is_main ? main_ : window_;
+    }
+
+    void insert(K key, std::shared_ptr<V> data)
+    {
+        auto loc = index_.find(key);
+        if(loc != nullptr)
+        {
+            segment(*loc)[loc->index].data = std::move(data);
+            return;
+        }
+
+        if(int(window_.size()) >= window_capacity_) { evict_from_window(); }
+        window_.push_back(entry{std::move(key), std::move(data), ++clock_});
+        index_.insert(location{false, int(window_.size()) - 1});
+    }
+
+    /**
+     * Moves the window's victim to the main cache. If the cache is full, the window's
+     * victim and the main cache's victim are evaluated and the one with the worse
+     * (estimated) access frequency is evicted instead.
+     */
+    void evict_from_window()
+    {
+        const int window_index = window_victim();
+        if(int(main_.size()) >= main_capacity_)
+        {
+            if(main_.empty())
+            {
+                evict(window_, window_index);
+                return;
+            }
+
+            const int main_index = main_victim();
+            const int window_victim_freq = filter_.frequency(window_[window_index].key);
+            const int main_victim_freq = filter_.frequency(main_[main_index].key);
+            if(window_victim_freq <= main_victim_freq)
+            {
+                evict(window_, window_index);
+                return;
+            }
+            evict(main_, main_index);
+        }
+
+        *index_.find(window_[window_index].key) = location{true, int(main_.size())};
+        main_.push_back(std::move(window_[window_index]));
+        remove(window_, window_index);
+    }
+
+    /** Returns the index of the least recently used of the sampled window entries. */
+    int window_victim()
+    {
+        return sample(window_, [this](const entry& e) { return clock_ - e.last_access; });
+    }
+
+    /** Returns the index of the least frequently used of the sampled main entries. */
+    int main_victim()
+    {
+        // The complement orders lower frequencies first.
+        return sample(main_, [this](const entry& e)
+            { return ~uint32_t(filter_.frequency(e.key)); });
+    }
+
+    /**
+     * Returns the index of the entry with the highest $score among $sample_size_
+     * random entries of $s (or among all entries, if there are no more than that).
+     */
+    template<typename Score>
+    int sample(const std::vector<entry>& s, Score score)
+    {
+        const int n = s.size();
+        if(n <= sample_size_)
+        {
+            int best = 0;
+            for(auto i = 1; i < n; ++i)
+            {
+                if(score(s[i]) > score(s[best])) { best = i; }
+            }
+            return best;
+        }
+
+        std::uniform_int_distribution<int> dist(0, n - 1);
+        int best = dist(rng_);
+        uint32_t best_score = score(s[best]);
+        for(auto i = 1; i < sample_size_; ++i)
+        {
+            const int candidate = dist(rng_);
+            const uint32_t candidate_score = score(s[candidate]);
+            if(candidate_score > best_score)
+            {
+                best = candidate;
+                best_score = candidate_score;
+            }
+        }
+        return best;
+    }
+
+    void evict(std::vector<entry>& s, const int index)
+    {
+        index_.erase(s[index].key);
+        remove(s, index);
+    }
+
+    /**
+     * Removes the entry at $index from $s by moving the last entry in its place
+     * (but leaves the index alone as far as the removed entry is concerned).
+     */
+    void remove(std::vector<entry>& s, const int index)
+    {
+        if(index != int(s.size()) - 1)
+        {
+            index_.find(s.back().key)->index = index;
+            s[index] = std::move(s.back());
+        }
+        s.pop_back();
+    }
+};
+
+#endif
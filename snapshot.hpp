@@ -0,0 +1,150 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef SNAPSHOT_HEADER
+#define SNAPSHOT_HEADER
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * Binary I/O primitives shared by the cache's snapshot format.
+ *
+ * Snapshots are written in the host's byte order and are meant to be restored on the
+ * same architecture, e.g. across restarts of a service.
+ */
+namespace snapshot
+{
+    // "WTLF" when read as a little endian integer.
+    constexpr uint32_t magic = 0x464c5457;
+    constexpr uint32_t version = 2;
+
+    template<typename T>
+    void write_pod(std::ostream& out, const T& t)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+            "only trivially copyable types can be written as raw bytes");
+        out.write(reinterpret_cast<const char*>(&t), sizeof t);
+    }
+
+    template<typename T>
+    T read_pod(std::istream& in)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+            "only trivially copyable types can be read as raw bytes");
+        T t;
+        if(!in.read(reinterpret_cast<char*>(&t), sizeof t))
+        {
+            throw std::runtime_error("unexpected end of snapshot");
+        }
+        return t;
+    }
+
+    /** Writes the snapshot header and throws if $out is in a failed state. */
+    inline void write_header(std::ostream& out)
+    {
+        write_pod(out, magic);
+        write_pod(out, version);
+        if(!out) { throw std::runtime_error("could not write snapshot"); }
+    }
+
+    /** Reads and validates the snapshot header. */
+    inline void read_header(std::istream& in)
+    {
+        if(read_pod<uint32_t>(in) != magic)
+        {
+            throw std::runtime_error("not a wtinylfu snapshot");
+        }
+        if(read_pod<uint32_t>(in) != version)
+        {
+            throw std::runtime_error("unsupported wtinylfu snapshot version");
+        }
+    }
+
+    /**
+     * The header of the memory mappable snapshot layout, used for trivially copyable
+     * keys and values. It's followed by the keys of all entries, then (aligned to a
+     * cache line) their values in the same order, and finally (again aligned) the
+     * frequency sketch. Entries are grouped by segment like in the stream format:
+     * eden, probationary, then window, each from MRU to LRU.
+     */
+    struct mapped_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t num_pages[3];
+        uint32_t key_size;
+        uint32_t value_size;
+        uint64_t keys_offset;
+        uint64_t values_offset;
+        uint64_t sketch_offset;
+    };
+    static_assert(sizeof(mapped_header) == 64, "mapped_header must be 64 bytes");
+
+    // "WTLM" when read as a little endian integer.
+    constexpr uint32_t mapped_magic = 0x4d4c5457;
+    constexpr uint32_t mapped_version = 1;
+    constexpr uint64_t mapped_alignment = 64;
+
+    constexpr uint64_t align_up(const uint64_t n, const uint64_t alignment) noexcept
+    {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    /** Pads $out with zeros up to the next multiple of $alignment. */
+    inline void write_padding(std::ostream& out, const uint64_t alignment)
+    {
+        const uint64_t pos = out.tellp();
+        for(auto i = pos; i < align_up(pos, alignment); ++i) { out.put(0); }
+    }
+
+    // "WTLH" when read as a little endian integer. A hints file is this magic and
+    // $hints_version, the number of hints, and for each hint its key (written by
+    // a codec's write_key), its frequency and its cache slot as single bytes.
+    constexpr uint32_t hints_magic = 0x484c5457;
+    constexpr uint32_t hints_version = 1;
+
+    /**
+     * A codec tells the cache how to write keys and values to a snapshot and how to
+     * read them back. It must provide:
+     *
+     *     void write_key(std::ostream&, const K&) const;
+     *     K read_key(std::istream&) const;
+     *     void write_value(std::ostream&, const V&) const;
+     *     V read_value(std::istream&) const;
+     *
+     * This is the default codec, which copies the raw bytes of trivially copyable
+     * keys and values.
+     */
+    template<typename K, typename V>
+    struct trivial_codec
+    {
+        void write_key(std::ostream& out, const K& key) const { write_pod(out, key); }
+        K read_key(std::istream& in) const { return read_pod<K>(in); }
+        void write_value(std::ostream& out, const V& value) const { write_pod(out, value); }
+        V read_value(std::istream& in) const { return read_pod<V>(in); }
+    };
+} // namespace snapshot
+
+#endif
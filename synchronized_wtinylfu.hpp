@@ -0,0 +1,424 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef SYNCHRONIZED_WTINYLFU_HEADER
+#define SYNCHRONIZED_WTINYLFU_HEADER
+
+#include "wtinylfu.hpp"
+
+#include <mutex>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <climits>
+#include <istream>
+#include <ostream>
+#include <algorithm>
+
+/**
+ * A thread-safe wrapper around wtinylfu_cache. All operations are serialized on a
+ * single mutex, since even a cache hit modifies the cache's internal state.
+ *
+ * Loads through get_and_insert_if_missing are coalesced per key (single-flight):
+ * if several threads miss the same key at the same time, only the first one runs
+ * its value loader, while the others wait for (and share) its result. The lock is
+ * not held while the loader runs, so loads of different keys proceed in parallel
+ * and other operations are not blocked by a slow loader. If the loader throws, the
+ * exception is rethrown in every thread waiting on that load and nothing is
+ * inserted.
+ */
+template<
+    typename K,
+    typename V,
+    template<typename> class MainPolicy = slru_policy,
+    template<typename> class WindowSegment = lru_segment,
+    typename Admission = single_victim_admission
+> class synchronized_wtinylfu_cache
+{
+    using load_future = std::shared_future<std::shared_ptr<V>>;
+    using cache_type = wtinylfu_cache<K, V, MainPolicy, WindowSegment, Admission>;
+
+public:
+    using removal_cause = typename cache_type::removal_cause;
+    using removal_listener = typename cache_type::removal_listener;
+    using removal_delivery = typename cache_type::removal_delivery;
+    using removal_notification = typename cache_type::removal_notification;
+    using dirty_entry = typename cache_type::dirty_entry;
+    using flush_callback = typename cache_type::flush_callback;
+
+private:
+
+    cache_type cache_;
+    mutable std::mutex mutex_;
+
+    // Loads that are currently in progress, keyed by the key being loaded.
+    std::unordered_map<K, load_future> loads_;
+
+    struct prefetch_thread
+    {
+        std::thread thread;
+        // Set by the thread when it's about to exit, so that it can be joined
+        // without blocking.
+        std::shared_ptr<std::atomic<bool>> is_finished;
+    };
+
+    // The threads started by prefetch. Finished ones are joined by the next call to
+    // prefetch, the rest on destruction, before which they are told to stop after
+    // their current batch.
+    std::vector<prefetch_thread> prefetch_threads_;
+    std::atomic<bool> stop_prefetching_{false};
+
+public:
+    explicit synchronized_wtinylfu_cache(int capacity) : cache_(capacity) {}
+
+    ~synchronized_wtinylfu_cache()
+    {
+        stop_prefetching_ = true;
+        for(auto& t : prefetch_threads_) { t.thread.join(); }
+    }
+
+    int size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.size();
+    }
+
+    int capacity() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.capacity();
+    }
+
+    int num_cache_hits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.num_cache_hits();
+    }
+
+    int num_cache_misses() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.num_cache_misses();
+    }
+
+    bool contains(const K& key) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.contains(key);
+    }
+
+    void change_capacity(const int n)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.change_capacity(n);
+    }
+
+    /**
+     * See wtinylfu_cache::set_removal_listener. A synchronously delivered listener
+     * runs with the cache's lock held, so it must not call any method of this cache,
+     * which would deadlock. With batched delivery the listener is run by
+     * deliver_removal_notifications without the lock held, so it may call back into
+     * the cache, but the notifications (and the removed values) pile up until they're
+     * delivered: use removal_deliverer to deliver them periodically.
+     */
+    void set_removal_listener(removal_listener listener,
+        const removal_delivery delivery = removal_delivery::synchronous)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.set_removal_listener(std::move(listener), delivery);
+    }
+
+    /**
+     * Invokes the removal listener with each queued notification, without holding
+     * the lock, so it may be called from a background thread.
+     */
+    void deliver_removal_notifications()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto notifications = cache_.take_removal_notifications();
+        removal_listener listener = cache_.removal_listener_;
+        lock.unlock();
+
+        if(!listener) { return; }
+        for(auto& n : notifications)
+        {
+            listener(n.key, std::move(n.value), n.cause);
+        }
+    }
+
+    /** See wtinylfu_cache::take_removal_notifications. */
+    std::vector<removal_notification> take_removal_notifications()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.take_removal_notifications();
+    }
+
+    void change_capacity_incrementally(const int n)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.change_capacity_incrementally(n);
+    }
+
+    int num_excess_entries() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.num_excess_entries();
+    }
+
+    int evict_excess(const int max_evictions)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.evict_excess(max_evictions);
+    }
+
+    std::shared_ptr<V> get(const K& key)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.get(key);
+    }
+
+    std::shared_ptr<V> operator[](const K& key)
+    {
+        return get(key);
+    }
+
+    template<typename ValueLoader>
+    std::shared_ptr<V> get_and_insert_if_missing(const K& key, ValueLoader value_loader)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::shared_ptr<V> value = cache_.get(key);
+        if(value != nullptr) { return value; }
+
+        auto it = loads_.find(key);
+        if(it != loads_.end())
+        {
+            // Another thread is already loading this key, so wait for its result.
+            load_future load = it->second;
+            lock.unlock();
+            return load.get();
+        }
+        // Only a miss pays for the promise's shared state.
+        std::promise<std::shared_ptr<V>> promise;
+        loads_.emplace(key, promise.get_future().share());
+        lock.unlock();
+
+        try
+        {
+            value = std::make_shared<V>(value_loader(key));
+        }
+        catch(...)
+        {
+            lock.lock();
+            loads_.erase(key);
+            lock.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        lock.lock();
+        cache_.insert(key, value);
+        loads_.erase(key);
+        lock.unlock();
+        promise.set_value(value);
+        return value;
+    }
+
+    /**
+     * Loads the values of those of $keys that are not yet cached, in batches of
+     * $batch_size keys, with one call to $bulk_loader per batch (see
+     * wtinylfu_cache::get_all for its interface). The batches are loaded on a thread
+     * owned by the cache, without holding the lock while $bulk_loader runs. Loaded
+     * entries are inserted without being recorded as accesses.
+     *
+     * This is meant to warm up the cache after a restart, from the keys returned by
+     * load_hints. The returned future becomes ready when all batches are loaded,
+     * and rethrows the exception that stopped the prefetch, if any. Discarding it
+     * doesn't wait for the prefetch, but destroying the cache does: the destructor
+     * stops the prefetch after the batch being loaded and joins its thread, so
+     * $bulk_loader must not wait on anything that the destroying thread holds.
+     */
+    template<typename BulkLoader>
+    std::future<void> prefetch(std::vector<K> keys, BulkLoader bulk_loader,
+        const int batch_size = 256)
+    {
+        auto done = std::make_shared<std::promise<void>>();
+        auto result = done->get_future();
+        auto is_finished = std::make_shared<std::atomic<bool>>(false);
+        std::lock_guard<std::mutex> lock(mutex_);
+        join_finished_prefetch_threads();
+        // Reserved up front so that adding the started thread can't throw.
+        prefetch_threads_.reserve(prefetch_threads_.size() + 1);
+        std::thread thread(
+            [this, done, is_finished, bulk_loader, batch_size](
+                const std::vector<K>& keys) mutable
+            {
+                try
+                {
+                    prefetch_batches(keys, bulk_loader, batch_size);
+                    done->set_value();
+                }
+                catch(...)
+                {
+                    done->set_exception(std::current_exception());
+                }
+                *is_finished = true;
+            }, std::move(keys));
+        prefetch_threads_.push_back({std::move(thread), std::move(is_finished)});
+        return result;
+    }
+
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    void save_hints(std::ostream& out, const int max_keys, const Codec& codec = Codec()) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.save_hints(out, max_keys, codec);
+    }
+
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    std::vector<K> load_hints(std::istream& in, const Codec& codec = Codec())
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.load_hints(in, codec);
+    }
+
+    void insert(K key, V value)
+    {
+        auto data = std::make_shared<V>(std::move(value));
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.insert(std::move(key), std::move(data));
+    }
+
+    /** See wtinylfu_cache::insert_dirty. */
+    void insert_dirty(K key, V value)
+    {
+        auto data = std::make_shared<V>(std::move(value));
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.insert(std::move(key), std::move(data), true);
+    }
+
+    /**
+     * See wtinylfu_cache::set_flush_callback. The callback runs with the cache's
+     * lock held.
+     */
+    void set_flush_callback(flush_callback callback)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.set_flush_callback(std::move(callback));
+    }
+
+    int num_dirty() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.num_dirty();
+    }
+
+    /** See wtinylfu_cache::take_dirty_entries. */
+    std::vector<dirty_entry> take_dirty_entries(
+        const std::chrono::steady_clock::time_point dirty_before
+            = std::chrono::steady_clock::time_point::max(),
+        const int max_entries = INT_MAX)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cache_.take_dirty_entries(dirty_before, max_entries);
+    }
+
+    void erase(const K& key)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.erase(key);
+    }
+
+private:
+    void join_finished_prefetch_threads()
+    {
+        auto it = prefetch_threads_.begin();
+        while(it != prefetch_threads_.end())
+        {
+            if(*it->is_finished)
+            {
+                it->thread.join();
+                it = prefetch_threads_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    template<typename BulkLoader>
+    void prefetch_batches(const std::vector<K>& keys, BulkLoader& bulk_loader,
+        const std::size_t batch_size)
+    {
+        for(std::size_t i = 0; i < keys.size(); i += batch_size)
+        {
+            if(stop_prefetching_)
+            {
+                throw std::runtime_error("prefetch stopped by the cache's destruction");
+            }
+
+            const auto batch_end = std::min(keys.size(), i + batch_size);
+            std::vector<K> missing;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for(auto k = i; k < batch_end; ++k)
+                {
+                    if(!cache_.contains(keys[k])) { missing.push_back(keys[k]); }
+                }
+            }
+            if(missing.empty()) { continue; }
+
+            auto loaded = bulk_loader(missing);
+            if(loaded.size() != missing.size())
+            {
+                throw std::runtime_error(
+                    "bulk loader must return a value for each key");
+            }
+
+            std::vector<std::shared_ptr<V>> values;
+            values.reserve(loaded.size());
+            for(auto& value : loaded)
+            {
+                values.push_back(std::make_shared<V>(std::move(value)));
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            // Don't overwrite entries inserted while the batch was loading.
+            std::vector<K> batch_keys;
+            std::vector<std::shared_ptr<V>> batch_values;
+            for(std::size_t k = 0; k < missing.size(); ++k)
+            {
+                if(!cache_.contains(missing[k]))
+                {
+                    batch_keys.push_back(std::move(missing[k]));
+                    batch_values.push_back(std::move(values[k]));
+                }
+            }
+            cache_.insert_batch(batch_keys, batch_values);
+        }
+    }
+};
+
+#endif
@@ -1,12 +1,1263 @@
 #include "../wtinylfu.hpp"
+#include "../synchronized_wtinylfu.hpp"
+#include "../async_wtinylfu.hpp"
+#include "../capacity_controller.hpp"
+#include "../background_reclaimer.hpp"
+#include "../write_back_flusher.hpp"
+#include "../removal_deliverer.hpp"
+#include "../sampled_wtinylfu.hpp"
 #include "../bloom_filter.hpp"
 #include <iostream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <string>
 
 struct big_object
 {
     char data[4096];
 };
 
+void test_get_many()
+{
+    wtinylfu_cache<int, int> cache(64);
+    for(auto i = 0; i < 32; ++i) {
+        cache.insert(i, i * 2);
+    }
+
+    std::vector<int> keys;
+    for(auto i = 16; i < 48; ++i) {
+        keys.push_back(i);
+    }
+
+    std::vector<std::shared_ptr<int>> values;
+    cache.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+
+    assert(values.size() == keys.size());
+    for(auto i = 0; i < int(keys.size()); ++i) {
+        if(keys[i] < 32) {
+            assert(values[i] && *values[i] == keys[i] * 2);
+        } else {
+            assert(!values[i]);
+        }
+    }
+    assert(cache.num_cache_hits() == 16);
+    assert(cache.num_cache_misses() == 16);
+}
+
+void test_get_all()
+{
+    wtinylfu_cache<int, int> cache(128);
+    for(auto i = 0; i < 10; ++i) {
+        cache.insert(i, i);
+    }
+
+    int num_loader_calls = 0;
+    const std::vector<int> keys = {0, 5, 10, 11, 10, 200};
+    auto values = cache.get_all(keys, [&](const std::vector<int>& missing) {
+        ++num_loader_calls;
+        assert(missing.size() == 3);
+        std::vector<int> loaded;
+        for(auto key : missing) {
+            loaded.push_back(key);
+        }
+        return loaded;
+    });
+
+    assert(num_loader_calls == 1);
+    for(auto i = 0; i < int(keys.size()); ++i) {
+        assert(values[i] && *values[i] == keys[i]);
+        assert(cache.contains(keys[i]));
+    }
+    assert(cache.size() == 13);
+}
+
+void test_single_flight_load()
+{
+    synchronized_wtinylfu_cache<int, int> cache(128);
+    std::atomic<int> num_loader_calls(0);
+    std::atomic<int> num_correct_values(0);
+
+    std::vector<std::thread> threads;
+    for(auto i = 0; i < 8; ++i) {
+        threads.emplace_back([&] {
+            auto value = cache.get_and_insert_if_missing(42, [&](int key) {
+                ++num_loader_calls;
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                return key + 1;
+            });
+            if(value && *value == 43) {
+                ++num_correct_values;
+            }
+        });
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    assert(num_loader_calls == 1);
+    assert(num_correct_values == 8);
+
+    bool did_throw = false;
+    try {
+        cache.get_and_insert_if_missing(7, [](int) -> int {
+            throw std::runtime_error("load failed");
+        });
+    } catch(const std::runtime_error&) {
+        did_throw = true;
+    }
+    assert(did_throw);
+    assert(!cache.contains(7));
+}
+
+void test_async_load()
+{
+    async_wtinylfu_cache<int, int> cache(128);
+    std::atomic<int> num_loader_calls(0);
+    auto loader = [&](int key) {
+        ++num_loader_calls;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return key * 3;
+    };
+
+    auto a = cache.get(5, loader);
+    auto b = cache.get(5, loader);
+    assert(a == b);
+    assert(*a.get() == 15);
+    assert(*b.get() == 15);
+    assert(num_loader_calls == 1);
+
+    auto failed = cache.get(6, [](int) -> int { throw std::runtime_error("fail"); });
+    bool did_throw = false;
+    try {
+        failed.get();
+    } catch(const std::runtime_error&) {
+        did_throw = true;
+    }
+    assert(did_throw);
+    assert(!cache.contains(6));
+}
+
+struct inline_executor
+{
+    void operator()(const std::function<void()>& task) const { task(); }
+};
+
+void test_refresh_after_write()
+{
+    async_wtinylfu_cache<int, int> cache(128);
+    cache.set_refresh_interval(std::chrono::milliseconds(10));
+    std::atomic<int> version(0);
+    auto loader = [&](int) { return ++version; };
+
+    assert(*cache.get(1, loader).get() == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // The stale value is returned while the reload runs in the background.
+    auto stale = cache.get(1, loader);
+    assert(stale.is_ready());
+    assert(*stale.get() == 1 || *stale.get() == 2);
+    for(auto i = 0; i < 100 && *cache.get_if_present(1).get() != 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    assert(*cache.get_if_present(1).get() == 2);
+    assert(version == 2);
+
+    // With an inline executor, the reload runs within get, but not under the
+    // cache's lock, so the loader may use the cache.
+    async_wtinylfu_cache<int, int, inline_executor> inline_cache(128);
+    inline_cache.set_refresh_interval(std::chrono::milliseconds(1));
+    int num_loads = 0;
+    auto reentrant_loader = [&](int key) {
+        inline_cache.contains(key);
+        return ++num_loads;
+    };
+    assert(*inline_cache.get(1, reentrant_loader).get() == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    inline_cache.get(1, reentrant_loader);
+    assert(num_loads == 2);
+    assert(*inline_cache.get_if_present(1).get() == 2);
+}
+
+void test_snapshot()
+{
+    wtinylfu_cache<int, int> cache(256);
+    for(auto i = 0; i < 300; ++i) {
+        cache.insert(i, i * i);
+        cache.get(i % 50);
+    }
+
+    std::stringstream snapshot;
+    cache.save_snapshot(snapshot);
+
+    wtinylfu_cache<int, int> restored(256);
+    restored.load_snapshot(snapshot);
+    assert(restored.size() == cache.size());
+    for(auto i = 0; i < 300; ++i) {
+        assert(restored.contains(i) == cache.contains(i));
+        if(cache.contains(i)) {
+            assert(*restored.peek(i) == i * i);
+        }
+    }
+
+    snapshot.clear();
+    snapshot.seekg(0);
+    wtinylfu_cache<int, int> smaller(100);
+    smaller.load_snapshot(snapshot);
+    assert(smaller.size() == 100);
+
+    const char* path = "wtinylfu_snapshot_test.bin";
+    cache.save_snapshot_file(path);
+    wtinylfu_cache<int, int> mapped(256);
+    mapped.load_snapshot_file(path);
+    for(auto i = 0; i < 300; ++i) {
+        assert(mapped.contains(i) == cache.contains(i));
+        if(cache.contains(i)) {
+            assert(*mapped.peek(i) == i * i);
+        }
+    }
+    // Saving over the mapped file must not pull it from under the mapped values.
+    mapped.save_snapshot_file(path);
+    wtinylfu_cache<int, int> remapped(256);
+    remapped.load_snapshot_file(path);
+    for(auto i = 0; i < 300; ++i) {
+        assert(remapped.contains(i) == cache.contains(i));
+        if(cache.contains(i)) {
+            assert(*mapped.peek(i) == i * i && *remapped.peek(i) == i * i);
+        }
+    }
+    std::remove(path);
+
+    // Corrupt headers are rejected, even if the page counts are large enough for
+    // their sizes to overflow.
+    const char* corrupt_path = "wtinylfu_snapshot_corrupt.bin";
+    const auto load_corrupted = [&](const std::streamoff offset, const uint64_t value) {
+        cache.save_snapshot_file(corrupt_path);
+        {
+            std::fstream file(corrupt_path,
+                std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(offset);
+            snapshot::write_pod(file, value);
+        }
+        bool threw = false;
+        wtinylfu_cache<int, int> corrupt(256);
+        try { corrupt.load_snapshot_file(corrupt_path); }
+        catch(const std::runtime_error&) { threw = true; }
+        std::remove(corrupt_path);
+        return threw;
+    };
+    // num_pages[0] and keys_offset.
+    assert(load_corrupted(8, uint64_t(1) << 62));
+    assert(load_corrupted(8, uint64_t(-1)));
+    assert(load_corrupted(40, 0));
+
+    wtinylfu_cache<int, std::string> strings(16);
+    strings.insert(1, "one");
+    struct string_codec : snapshot::trivial_codec<int, int> {
+        void write_value(std::ostream& out, const std::string& s) const {
+            snapshot::write_pod(out, uint32_t(s.size()));
+            out.write(s.data(), s.size());
+        }
+        std::string read_value(std::istream& in) const {
+            std::string s(snapshot::read_pod<uint32_t>(in), '\0');
+            in.read(&s[0], s.size());
+            return s;
+        }
+    };
+    strings.save_snapshot_file(path, string_codec());
+    wtinylfu_cache<int, std::string> restored_strings(16);
+    restored_strings.load_snapshot_file(path, string_codec());
+    assert(*restored_strings.peek(1) == "one");
+    std::remove(path);
+
+    frequency_sketch<int> sketch(512);
+    for(auto i = 0; i < 1000; ++i) {
+        sketch.record_access(i % 37);
+    }
+    std::stringstream sketch_file;
+    sketch.save(sketch_file);
+    frequency_sketch<int> loaded_sketch(16);
+    loaded_sketch.load(sketch_file);
+    for(auto i = 0; i < 100; ++i) {
+        assert(loaded_sketch.frequency(i) == sketch.frequency(i));
+    }
+}
+
+void test_hints()
+{
+    wtinylfu_cache<int, int> cache(128);
+    for(auto i = 0; i < 128; ++i) {
+        cache.insert(i, i);
+    }
+    for(auto n = 0; n < 8; ++n) {
+        for(auto i = 10; i < 20; ++i) {
+            cache.get(i);
+        }
+    }
+
+    std::stringstream hints;
+    cache.save_hints(hints, 10);
+
+    synchronized_wtinylfu_cache<int, int> restarted(128);
+    auto keys = restarted.load_hints(hints);
+    assert(keys.size() == 10);
+    for(auto key : keys) {
+        assert(key >= 10 && key < 20);
+    }
+
+    restarted.prefetch(keys, [](const std::vector<int>& missing) {
+        return missing;
+    }, 4).get();
+    for(auto i = 10; i < 20; ++i) {
+        assert(restarted.contains(i));
+    }
+    assert(restarted.num_cache_hits() == 0);
+
+    // Repeated prefetches reuse the slots of the threads that have finished.
+    for(auto n = 0; n < 100; ++n) {
+        restarted.prefetch({100 + n}, [](const std::vector<int>& missing) {
+            return missing;
+        }).get();
+    }
+    assert(restarted.contains(199));
+
+    // Destroying the cache stops the prefetch after the batch being loaded.
+    std::atomic<bool> started(false);
+    std::atomic<bool> released(false);
+    std::future<void> prefetched;
+    std::thread releaser;
+    {
+        synchronized_wtinylfu_cache<int, int> cache(128);
+        prefetched = cache.prefetch(keys, [&](const std::vector<int>& missing) {
+            started = true;
+            while(!released) { std::this_thread::yield(); }
+            return missing;
+        }, 1);
+        while(!started) { std::this_thread::yield(); }
+        releaser = std::thread([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            released = true;
+        });
+    }
+    releaser.join();
+    bool stopped = false;
+    try { prefetched.get(); } catch(const std::runtime_error&) { stopped = true; }
+    assert(stopped);
+}
+
+void test_trace_recorder()
+{
+    const char* path = "wtinylfu_trace_test.bin";
+    wtinylfu_cache<int, int> cache(64);
+    {
+        trace_recorder::options options;
+        options.path = path;
+        options.record_timestamps = true;
+        options.record_hits = true;
+        options.buffer_size = 16;
+        cache.set_trace_recorder(std::make_shared<trace_recorder>(options));
+        cache.insert(1, 1);
+        for(auto i = 0; i < 100; ++i) {
+            cache.get(i % 10);
+        }
+        cache.set_trace_recorder(nullptr);
+    }
+
+    trace_reader reader(path);
+    assert(reader.has_timestamps() && reader.has_hits());
+    trace_event e;
+    int num_events = 0;
+    int num_hits = 0;
+    int64_t last_timestamp = 0;
+    while(reader.next(e)) {
+        assert(e.key_hash == detail::fold_hash(std::hash<int>()(num_events % 10)));
+        assert(e.timestamp >= last_timestamp);
+        last_timestamp = e.timestamp;
+        num_hits += e.is_hit;
+        ++num_events;
+    }
+    assert(num_events == 100);
+    assert(num_hits == 10);
+
+    // A recorder never picks up the events a thread buffered for an earlier one,
+    // even if it's created at the same address.
+    for(auto n = 1; n <= 3; ++n) {
+        {
+            trace_recorder::options options;
+            options.path = path;
+            trace_recorder recorder(options);
+            for(auto i = 0; i < n; ++i) {
+                recorder.record(uint32_t(n), false);
+            }
+        }
+        trace_reader reader(path);
+        num_events = 0;
+        while(reader.next(e)) {
+            assert(e.key_hash == uint32_t(n));
+            ++num_events;
+        }
+        assert(num_events == n);
+    }
+    std::remove(path);
+}
+
+void test_miss_ratio_curve()
+{
+    wtinylfu_cache<int, int> cache(100);
+    miss_ratio_curve_estimator::options options;
+    options.initial_sampling_rate = 1.0;
+    options.max_sampled_keys = 512;
+    options.bucket_size = 50;
+    options.num_buckets = 20;
+    cache.set_miss_ratio_curve_estimator(
+        std::make_shared<miss_ratio_curve_estimator>(options));
+
+    // Cyclic accesses of 500 keys: all misses below 500 entries, all hits above.
+    for(auto n = 0; n < 20; ++n) {
+        for(auto i = 0; i < 500; ++i) {
+            cache.get(i);
+        }
+    }
+
+    auto curve = cache.miss_ratio_curve();
+    assert(curve.size() == 20);
+    for(const auto& point : curve) {
+        if(point.first <= 400) {
+            assert(point.second > 0.9);
+        } else if(point.first >= 600) {
+            assert(point.second < 0.15);
+        }
+    }
+}
+
+void test_shadow_caches()
+{
+    wtinylfu_cache<int, int> cache(1000);
+    cache.add_shadow_cache(1000, 0.01f, 1.0);
+    cache.add_shadow_cache(250, 0.01f, 0.5);
+    cache.add_shadow_cache(4000, 0.2f, 0.5);
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(0, 5000);
+    for(auto i = 0; i < 200000; ++i) {
+        const auto key = dist(rng);
+        if(!cache.get(key)) {
+            cache.insert(key, key);
+        }
+    }
+
+    const double hit_ratio = double(cache.num_cache_hits())
+        / (cache.num_cache_hits() + cache.num_cache_misses());
+    auto shadows = cache.shadow_caches();
+    assert(shadows.size() == 3);
+    assert(std::abs(shadows[0].hit_ratio() - hit_ratio) < 0.02);
+    assert(shadows[1].hit_ratio() < hit_ratio);
+    assert(shadows[2].hit_ratio() > hit_ratio);
+
+    // Scaled down to a single entry, a shadow cache would have no main cache.
+    cache.add_shadow_cache(100, 0.01f, 0.01);
+    cache.add_shadow_cache(100, 0.9f, 0.01);
+    for(auto i = 0; i < 100000; ++i) {
+        cache.get(dist(rng));
+    }
+    assert(cache.shadow_caches().size() == 5);
+
+    // Neither may a window that takes up (almost) the whole cache.
+    using cache_type = wtinylfu_cache<int, int>;
+    const int min_capacity = cache_type::min_capacity(0.99f);
+    assert(min_capacity > 2);
+    bool threw = false;
+    try { cache_type c(min_capacity - 1, 0.99f); } catch(const std::invalid_argument&) { threw = true; }
+    assert(threw);
+    cache_type large_window(min_capacity, 0.99f);
+    for(auto i = 0; i < 1000; ++i) {
+        large_window.insert(i, i);
+    }
+    assert(large_window.size() == min_capacity);
+}
+
+void test_capacity_controller()
+{
+    wtinylfu_cache<int, big_object> cache(1000);
+    for(auto i = 0; i < 1000; ++i) {
+        cache.insert(i, big_object());
+    }
+
+    using controller_type = capacity_controller<wtinylfu_cache<int, big_object>>;
+    controller_type::options options;
+    options.memory_budget = 500 * sizeof(big_object);
+    options.max_step = 0.1;
+    options.max_evictions = 50;
+    options.cgroup_path = "/nonexistent";
+    double pressure = 0;
+    controller_type controller(cache, options,
+        [&cache] { return uint64_t(cache.size()) * sizeof(big_object); },
+        [&pressure] { return pressure; });
+
+    // Shrinks by at most 10% per step, evicting at most 50 entries per step, until
+    // the budget is met.
+    assert(controller.adjust() == 900);
+    assert(cache.size() == 950);
+    // The excess is evicted before the capacity changes again.
+    assert(controller.adjust() == 810);
+    assert(cache.size() == 900);
+    for(auto i = 0; i < 40; ++i) {
+        controller.adjust();
+    }
+    assert(std::abs(cache.capacity() - 500) <= 5);
+    assert(cache.size() <= 500);
+
+    // Memory pressure shrinks the cache even within budget.
+    const int capacity = cache.capacity();
+    assert(controller.adjust() >= capacity);
+    pressure = 50;
+    assert(controller.adjust() < capacity);
+    assert(cache.size() <= cache.capacity());
+
+    // The capacity never drops below the minimum, which leaves room for the main
+    // cache.
+    for(auto i = 0; i < 200; ++i) {
+        controller.adjust();
+    }
+    assert(cache.capacity() == 2);
+    for(auto i = 0; i < 10; ++i) {
+        cache.insert(1000 + i, big_object());
+    }
+    assert(cache.size() == 2);
+
+    options.min_capacity = 1;
+    bool threw = false;
+    try { controller_type c(cache, options); } catch(const std::invalid_argument&) { threw = true; }
+    assert(threw);
+}
+
+void test_sketch_resize()
+{
+    frequency_sketch<int> sketch(1024);
+    for(auto n = 0; n < 8; ++n) {
+        for(auto i = 0; i < 64; ++i) {
+            sketch.record_access(i);
+        }
+    }
+
+    std::vector<int> frequencies;
+    for(auto i = 0; i < 64; ++i) {
+        frequencies.push_back(sketch.frequency(i));
+        assert(frequencies.back() >= 8);
+    }
+
+    // Growing preserves every estimate exactly, shrinking never lowers one.
+    sketch.change_capacity(4096);
+    for(auto i = 0; i < 64; ++i) {
+        assert(sketch.frequency(i) == frequencies[i]);
+    }
+    sketch.change_capacity(256);
+    for(auto i = 0; i < 64; ++i) {
+        assert(sketch.frequency(i) >= frequencies[i]);
+    }
+}
+
+void test_incremental_shrink()
+{
+    wtinylfu_cache<int, int> cache(1000);
+    for(auto i = 0; i < 1000; ++i) {
+        cache.insert(i, i);
+        cache.get(i);
+        cache.get(i);
+    }
+
+    cache.change_capacity_incrementally(100);
+    assert(cache.capacity() == 100);
+    assert(cache.size() == 1000);
+    assert(cache.num_excess_entries() == 900);
+
+    assert(cache.evict_excess(100) == 100);
+    for(auto i = 0; i < 300; ++i) {
+        cache.insert(1000 + i, i);
+    }
+    assert(cache.num_excess_entries() == 0);
+    assert(cache.size() <= 100);
+}
+
+template<template<typename> class MainPolicy>
+void test_shrink_below_main()
+{
+    // Shrinking incrementally leaves the window over capacity while main is
+    // still empty, so the next insertion has no main victim to duel against.
+    wtinylfu_cache<int, int, MainPolicy> cache(1000);
+    for(auto i = 0; i < 10; ++i) {
+        cache.insert(i, i);
+    }
+    cache.change_capacity_incrementally(5);
+    cache.insert(10, 10);
+    while(cache.evict_excess(1) > 0) {}
+    assert(cache.size() <= 5);
+    for(auto i = 11; i < 100; ++i) {
+        cache.insert(i, i);
+    }
+    assert(cache.size() == 5);
+
+    // A capacity of one would leave no room in the main segment at all.
+    bool threw = false;
+    try { cache.change_capacity(1); } catch(const std::invalid_argument&) { threw = true; }
+    assert(threw);
+    cache.change_capacity(2);
+    assert(cache.size() == 2);
+    for(auto i = 0; i < 100; ++i) {
+        cache.insert(i, i);
+        cache.get(i);
+    }
+    assert(cache.size() == 2);
+    assert(cache.contains(99));
+}
+
+void test_deferred_reclamation()
+{
+    wtinylfu_cache<int, big_object> cache(100);
+    cache.set_deferred_reclamation(true);
+    for(auto i = 0; i < 300; ++i) {
+        cache.insert(i, big_object());
+    }
+    assert(cache.num_reclaimable() == 200);
+    assert(cache.reclaim(50) == 50);
+    assert(cache.num_reclaimable() == 150);
+
+    background_reclaimer reclaimer;
+    reclaimer.submit(cache.take_reclaimable());
+    assert(cache.num_reclaimable() == 0);
+}
+
+void test_removal_listener()
+{
+    using cache_type = wtinylfu_cache<int, int>;
+    cache_type cache(100);
+    std::map<cache_type::removal_cause, int> num_removals;
+    cache.set_removal_listener(
+        [&](const int&, std::shared_ptr<int> value, cache_type::removal_cause cause) {
+            assert(value);
+            ++num_removals[cause];
+        });
+
+    for(auto i = 0; i < 200; ++i) {
+        cache.insert(i, i);
+    }
+    assert(num_removals[cache_type::removal_cause::evicted]
+        + num_removals[cache_type::removal_cause::rejected] == 100);
+
+    cache.insert(199, 0);
+    assert(num_removals[cache_type::removal_cause::replaced] == 1);
+    cache.erase(199);
+    assert(num_removals[cache_type::removal_cause::erased] == 1);
+
+    num_removals.clear();
+    cache.set_removal_listener(
+        [&](const int&, std::shared_ptr<int>, cache_type::removal_cause cause) {
+            ++num_removals[cause];
+        }, cache_type::removal_delivery::batched);
+    cache.change_capacity(50);
+    assert(num_removals.empty());
+    assert(!cache.take_removal_notifications().empty());
+    const int size = cache.size();
+    cache.clear();
+    cache.deliver_removal_notifications();
+    assert(num_removals[cache_type::removal_cause::erased] == size);
+
+    // Batched notifications are delivered without the synchronized cache's lock
+    // held, so the listener may call back into the cache.
+    using sync_cache_type = synchronized_wtinylfu_cache<int, int>;
+    sync_cache_type sync_cache(100);
+    int num_evictions = 0;
+    sync_cache.set_removal_listener(
+        [&](const int& key, std::shared_ptr<int>, cache_type::removal_cause) {
+            assert(!sync_cache.contains(key));
+            ++num_evictions;
+        }, cache_type::removal_delivery::batched);
+    for(auto i = 0; i < 200; ++i) {
+        sync_cache.insert(i, i);
+    }
+    assert(num_evictions == 0);
+    sync_cache.deliver_removal_notifications();
+    assert(num_evictions == 100);
+
+    // The deliverer drains the queue periodically, and fully when destroyed.
+    std::atomic<int> num_delivered(0);
+    {
+        removal_deliverer<sync_cache_type>::options opts;
+        opts.interval = std::chrono::milliseconds(1);
+        removal_deliverer<sync_cache_type> deliverer(sync_cache,
+            [&](const int& key, std::shared_ptr<int>, cache_type::removal_cause) {
+                assert(!sync_cache.contains(key));
+                ++num_delivered;
+            }, opts);
+        for(auto i = 200; i < 300; ++i) {
+            sync_cache.insert(i, i);
+        }
+        while(num_delivered < 50) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for(auto i = 300; i < 400; ++i) {
+            sync_cache.insert(i, i);
+        }
+    }
+    assert(num_delivered == 200);
+    assert(sync_cache.take_removal_notifications().empty());
+    sync_cache.insert(400, 400);
+    sync_cache.insert(401, 401);
+    assert(num_delivered == 200);
+    assert(sync_cache.take_removal_notifications().empty());
+}
+
+void test_write_back()
+{
+    wtinylfu_cache<int, int> cache(100);
+    std::map<int, int> store;
+    cache.set_flush_callback([&](const int& key, std::shared_ptr<int> value) {
+        store[key] = *value;
+    });
+
+    cache.insert_dirty(1, 1);
+    cache.insert_dirty(1, 2);
+    cache.insert_dirty(2, 2);
+    cache.insert(3, 3);
+    assert(cache.num_dirty() == 2);
+
+    // Coalesced: one write with the latest value.
+    auto entries = cache.take_dirty_entries();
+    assert(entries.size() == 2);
+    assert(entries[0].first == 1 && *entries[0].second == 2);
+    assert(cache.num_dirty() == 0);
+    assert(cache.take_dirty_entries().empty());
+
+    // A mark left by an earlier dirtying of the same entry is stale: the entry is
+    // taken once, in the order of when it last became dirty.
+    cache.insert_dirty(1, 3);
+    cache.insert(1, 4);
+    cache.insert_dirty(2, 3);
+    cache.insert_dirty(1, 5);
+    entries = cache.take_dirty_entries();
+    assert(entries.size() == 2);
+    assert(entries[0].first == 2 && entries[1].first == 1 && *entries[1].second == 5);
+    assert(cache.num_dirty() == 0);
+
+    // Dirty entries are written back when evicted.
+    for(auto i = 0; i < 50; ++i) {
+        cache.insert_dirty(i, i);
+    }
+    cache.change_capacity(10);
+    assert(int(store.size()) == 50 - cache.size());
+    assert(cache.num_dirty() == cache.size());
+    cache.clear();
+    assert(store.size() == 50);
+    assert(cache.num_dirty() == 0);
+
+    synchronized_wtinylfu_cache<int, int> sync_cache(1000);
+    std::atomic<int> num_batches(0);
+    std::atomic<int> num_written(0);
+    {
+        write_back_flusher<synchronized_wtinylfu_cache<int, int>>::options opts;
+        opts.max_delay = std::chrono::milliseconds(20);
+        opts.max_batch_size = 100;
+        write_back_flusher<synchronized_wtinylfu_cache<int, int>> flusher(sync_cache,
+            [&](std::vector<std::pair<int, std::shared_ptr<int>>> entries) {
+                assert(int(entries.size()) <= 100);
+                ++num_batches;
+                num_written += entries.size();
+            }, opts);
+        for(auto round = 0; round < 10; ++round) {
+            for(auto i = 0; i < 300; ++i) {
+                sync_cache.insert_dirty(i, round);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    }
+    assert(num_written >= 300 && num_written < 3000);
+    assert(num_batches >= 3);
+
+    // Half of a 1ms delay is still a nonzero period, so the flusher doesn't spin.
+    struct counting_cache
+    {
+        using dirty_entry = synchronized_wtinylfu_cache<int, int>::dirty_entry;
+        synchronized_wtinylfu_cache<int, int>& cache;
+        std::atomic<int> num_takes{0};
+
+        std::vector<dirty_entry> take_dirty_entries(
+            std::chrono::steady_clock::time_point dirty_before, int max_entries)
+        {
+            ++num_takes;
+            return cache.take_dirty_entries(dirty_before, max_entries);
+        }
+    };
+    counting_cache counting{sync_cache};
+    num_written = 0;
+    const auto start = std::chrono::steady_clock::now();
+    {
+        write_back_flusher<counting_cache>::options opts;
+        opts.max_delay = std::chrono::milliseconds(1);
+        write_back_flusher<counting_cache> flusher(counting,
+            [&](std::vector<std::pair<int, std::shared_ptr<int>>> entries) {
+                num_written += entries.size();
+            }, opts);
+        sync_cache.insert_dirty(0, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(num_written == 1);
+    }
+    // At most one take per 0.5ms period, plus the final flush.
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    assert(counting.num_takes > 0 && counting.num_takes <= elapsed / 500 + 2);
+}
+
+template<template<typename> class MainPolicy>
+void test_eviction_policy()
+{
+    wtinylfu_cache<int, int, MainPolicy> cache(100);
+    std::mt19937 gen(42);
+    std::geometric_distribution<int> skewed(0.02);
+    for(auto i = 0; i < 20000; ++i) {
+        const int key = skewed(gen);
+        if(!cache.get(key)) {
+            cache.insert(key, key);
+        }
+        assert(cache.size() <= cache.capacity());
+    }
+    // Most accesses go to the 100 hottest keys, which should mostly be cached.
+    assert(cache.num_cache_hits() > 0.7 * 20000);
+    for(auto k = 0; k < 10; ++k) {
+        assert(cache.contains(k));
+    }
+
+    std::stringstream buffer;
+    cache.save_snapshot(buffer);
+    wtinylfu_cache<int, int, MainPolicy> restored(100);
+    restored.load_snapshot(buffer);
+    assert(restored.size() == cache.size());
+
+    cache.change_capacity(20);
+    assert(cache.size() <= 20);
+    cache.erase(0);
+    assert(!cache.contains(0));
+    cache.clear();
+    assert(cache.size() == 0);
+}
+
+void test_sampled_cache()
+{
+    sampled_wtinylfu_cache<int, int> cache(100);
+    for(auto i = 0; i < 100; ++i) {
+        cache.insert(i, i);
+    }
+    // Pump up the access frequencies of a few entries.
+    for(auto i = 0; i < 10; ++i) {
+        for(auto k = 0; k < 10; ++k) {
+            assert(cache[k] && *cache[k] == k);
+        }
+    }
+    for(auto i = 100; i < 1000; ++i) {
+        cache.insert(i, i);
+        assert(cache.size() <= cache.capacity());
+    }
+    for(auto k = 0; k < 10; ++k) {
+        assert(cache.contains(k));
+    }
+
+    cache.erase(0);
+    assert(!cache.contains(0) && !cache.peek(0));
+    cache.change_capacity(20);
+    assert(cache.size() == 20);
+    for(auto k = 1; k < 10; ++k) {
+        assert(cache.peek(k) && *cache.peek(k) == k);
+    }
+
+    // A capacity of one leaves no room in the main cache.
+    cache.change_capacity(1);
+    assert(cache.size() == 1);
+    for(auto i = 0; i < 100; ++i) {
+        cache.insert(i, i);
+        assert(cache.size() == 1);
+    }
+    cache.clear();
+    assert(cache.size() == 0);
+
+    // Entries move within and between the arrays as others are evicted; the index
+    // must keep up with them.
+    sampled_wtinylfu_cache<std::string, int> strings(100, 0.2f);
+    std::mt19937 gen(3);
+    std::geometric_distribution<int> skewed(0.01);
+    for(auto i = 0; i < 20000; ++i) {
+        const int k = skewed(gen);
+        if(!strings.get(std::to_string(k))) {
+            strings.insert(std::to_string(k), k);
+        }
+        if(i % 97 == 0) { strings.erase(std::to_string(k)); }
+    }
+    int num_cached = 0;
+    for(auto k = 0; k < 5000; ++k) {
+        if(auto value = strings.peek(std::to_string(k))) {
+            assert(*value == k);
+            ++num_cached;
+        }
+    }
+    assert(num_cached == strings.size());
+    assert(strings.num_cache_hits() > 0.5 * 20000);
+}
+
+struct test_page
+{
+    using key_type = int;
+
+    int key;
+    uint8_t reference_count = 0;
+    uint32_t promoted_at = 0;
+
+    explicit test_page(const int key) : key(key) {}
+};
+
+void test_lazy_promotion()
+{
+    wtinylfu_cache<int, int> eager(1000);
+    wtinylfu_cache<int, int> lazy(1000);
+    lazy.set_lazy_promotion(0.25f);
+    std::mt19937 gen(7);
+    std::geometric_distribution<int> skewed(0.002);
+    for(auto i = 0; i < 100000; ++i) {
+        const int key = skewed(gen);
+        if(!eager.get(key)) {
+            eager.insert(key, key);
+        }
+        if(!lazy.get(key)) {
+            lazy.insert(key, key);
+        }
+    }
+    assert(std::abs(lazy.num_cache_hits() - eager.num_cache_hits()) < 0.01 * 100000);
+
+    // With 8 pages and a fraction of 0.5, a page is recent until 4 more pages have
+    // been promoted after it.
+    lru_segment<test_page> segment(8);
+    segment.set_lazy_promotion(0.5f);
+    std::map<int, lru_segment<test_page>::page_position> pages;
+    for(auto i = 1; i <= 8; ++i) {
+        pages[i] = segment.insert(i);
+    }
+    const auto order = [&segment] {
+        std::vector<int> keys;
+        for(const auto& page : segment) { keys.push_back(page.key); }
+        return keys;
+    };
+    const std::vector<int> inserted = {8, 7, 6, 5, 4, 3, 2, 1};
+    assert(order() == inserted);
+
+    // A hit on a recently promoted page leaves the order unchanged...
+    segment.handle_hit(pages[6]);
+    assert(order() == inserted);
+    // ...while a hit past the threshold moves the page to the MRU position.
+    segment.handle_hit(pages[4]);
+    assert(order() == std::vector<int>({4, 8, 7, 6, 5, 3, 2, 1}));
+    segment.handle_hit(pages[5]);
+    assert(order() == std::vector<int>({5, 4, 8, 7, 6, 3, 2, 1}));
+    // Page 7 stays recent until the fourth promotion after its own.
+    segment.handle_hit(pages[7]);
+    assert(order() == std::vector<int>({5, 4, 8, 7, 6, 3, 2, 1}));
+    segment.handle_hit(pages[3]);
+    segment.handle_hit(pages[7]);
+    assert(order() == std::vector<int>({7, 3, 5, 4, 8, 6, 2, 1}));
+}
+
+void test_clock_window()
+{
+    // A hit only sets the reference bit, and the hand gives referenced pages a
+    // second chance before evicting the first unreferenced one.
+    clock_segment<test_page> segment(4);
+    std::map<int, clock_segment<test_page>::page_position> pages;
+    for(auto i = 1; i <= 4; ++i) {
+        pages[i] = segment.insert(i);
+    }
+    segment.handle_hit(pages[1]);
+    segment.handle_hit(pages[2]);
+    assert(segment.lru_pos() == pages[3]);
+    assert(pages[1]->reference_count == 0 && pages[2]->reference_count == 0);
+    segment.evict();
+    assert(segment.victim_key() == 4);
+
+    // A window large enough for the hand to matter, in front of a CLOCK main cache.
+    using cache_type = wtinylfu_cache<int, int, clock_policy, clock_segment>;
+    cache_type cache(100, 0.2f);
+    std::mt19937 gen(42);
+    std::geometric_distribution<int> skewed(0.02);
+    for(auto i = 0; i < 20000; ++i) {
+        const int key = skewed(gen);
+        if(!cache.get(key)) {
+            cache.insert(key, key);
+        }
+        assert(cache.size() <= cache.capacity());
+    }
+    assert(cache.num_cache_hits() > 0.7 * 20000);
+
+    std::stringstream buffer;
+    cache.save_snapshot(buffer);
+    cache_type restored(100, 0.2f);
+    restored.load_snapshot(buffer);
+    assert(restored.size() == cache.size());
+}
+
+struct test_slot_page
+{
+    using key_type = std::string;
+
+    std::string key;
+    detail::cache_slot cache_slot;
+    uint8_t reference_count = 0;
+    uint32_t promoted_at = 0;
+
+    test_slot_page(std::string key, const detail::cache_slot slot)
+        : key(std::move(key)), cache_slot(slot)
+    {}
+};
+
+void test_s3fifo_ghosts()
+{
+    // A key evicted from the small queue is remembered by its seeded std::hash, so
+    // an equal key in another string object is recognized and enters the main queue.
+    s3fifo_policy<test_slot_page> policy(10);
+    lru_segment<test_slot_page> window(10);
+    const auto admit = [&](const std::string& key) {
+        auto page = window.insert(key, detail::cache_slot::window);
+        policy.transfer_page_from(page, window);
+        return page;
+    };
+    admit("ghost");
+    admit("other");
+    assert(policy.victim_key() == "ghost");
+    policy.evict();
+    // Takes the freed page's memory, so the equal key lives at another address.
+    assert(admit("new")->cache_slot == detail::cache_slot::probationary);
+    auto page = admit(std::string("gho") + "st");
+    assert(page->cache_slot == detail::cache_slot::eden);
+}
+
+template<typename Admission>
+void test_admission()
+{
+    wtinylfu_cache<int, int, slru_policy, lru_segment, Admission> cache(100);
+    for(auto i = 0; i < 100; ++i) {
+        cache.insert(i, i);
+    }
+    // Pump up the access frequencies of a few entries.
+    for(auto i = 0; i < 10; ++i) {
+        for(auto k = 0; k < 10; ++k) {
+            assert(cache[k]);
+        }
+    }
+    std::mt19937 gen(3);
+    std::geometric_distribution<int> skewed(0.01);
+    for(auto i = 0; i < 20000; ++i) {
+        const int key = 100 + skewed(gen);
+        if(!cache.get(key)) {
+            cache.insert(key, key);
+        }
+        assert(cache.size() <= cache.capacity());
+    }
+    assert(cache.num_cache_hits() > 0.5 * 20000);
+}
+
+// Fills $cache such that the main cache's victim (key 0) is hot, the probationary
+// page before it (key 1) is cold, and the window's victim (key 99) is warm.
+template<template<typename> class MainPolicy, typename Admission>
+void fill_for_victim_selection(
+    wtinylfu_cache<int, int, MainPolicy, lru_segment, Admission>& cache)
+{
+    // Misses raise the frequencies without admitting or promoting anything.
+    for(auto i = 0; i < 10; ++i) { cache.get(0); }
+    for(auto i = 0; i < 5; ++i) { cache.get(99); }
+    for(auto i = 0; i < 100; ++i) {
+        cache.insert(i, i);
+    }
+    assert(cache.size() == cache.capacity());
+}
+
+void test_admission_victim_selection()
+{
+    // Plain TinyLFU only weighs the hot LRU page, so the warm candidate is rejected.
+    wtinylfu_cache<int, int, slru_policy, lru_segment, single_victim_admission> single(100);
+    fill_for_victim_selection(single);
+    single.insert(200, 200);
+    assert(single.contains(0) && single.contains(1) && !single.contains(99));
+
+    // The colder page before the LRU one is evicted in its stead.
+    wtinylfu_cache<int, int, slru_policy, lru_segment, coldest_of_admission<2>> coldest(100);
+    fill_for_victim_selection(coldest);
+    coldest.insert(200, 200);
+    assert(coldest.contains(0) && !coldest.contains(1) && coldest.contains(99));
+
+    // Unless its policy spared it: a hit S3-FIFO page has a nonzero reference count.
+    wtinylfu_cache<int, int, s3fifo_policy, lru_segment, coldest_of_admission<2>> spared(100);
+    fill_for_victim_selection(spared);
+    assert(spared.get(1));
+    spared.insert(200, 200);
+    assert(spared.contains(0) && spared.contains(1) && !spared.contains(99));
+}
+
+void test_hash_flooding()
+{
+    // An attacker who knows the hash function searches for keys whose counters
+    // coincide with those of a victim key in an unseeded sketch.
+    frequency_sketch<int> unseeded(16, 0);
+    for(auto i = 0; i < 15; ++i) {
+        unseeded.record_access(0);
+    }
+    std::vector<int> colliding_keys;
+    for(auto k = 1; k < 100000000 && colliding_keys.size() < 4; ++k) {
+        if(unseeded.frequency(k) == 15) {
+            colliding_keys.push_back(k);
+        }
+    }
+    assert(!colliding_keys.empty());
+
+    frequency_sketch<int> attacked(16, 0);
+    // Sketches are seeded randomly by default; a fixed seed keeps the test stable.
+    frequency_sketch<int> seeded(16, 0x9e3779b9);
+    for(auto i = 0; i < 15; ++i) {
+        for(auto k : colliding_keys) {
+            attacked.record_access(k);
+            seeded.record_access(k);
+        }
+    }
+    // The victim appears as hot as the attacker's keys, unless the hash is seeded.
+    assert(attacked.frequency(0) == 15);
+    assert(seeded.frequency(0) < 15);
+
+    // The seed is persisted along with the counters.
+    std::stringstream buffer;
+    seeded.save(buffer);
+    frequency_sketch<int> restored(16);
+    restored.load(buffer);
+    assert(restored.hash_seed() == seeded.hash_seed());
+    assert(restored.frequency(colliding_keys[0]) == seeded.frequency(colliding_keys[0]));
+}
+
+struct constant_hash
+{
+    std::size_t operator()(const std::string&) const noexcept { return 42; }
+};
+
+struct first_of
+{
+    const std::string& operator()(const std::pair<std::string, int>& p) const noexcept
+    {
+        return p.first;
+    }
+};
+
+struct identity
+{
+    uint16_t operator()(const uint16_t value) const noexcept { return value; }
+};
+
+void test_hash_index()
+{
+    // Every key collides, so lookups must fall back on comparing the keys.
+    hash_index<std::string, std::pair<std::string, int>, first_of, constant_hash> index;
+    for(auto i = 0; i < 100; ++i) {
+        index.insert({std::to_string(i), i});
+    }
+    assert(index.size() == 100);
+    for(auto i = 0; i < 100; ++i) {
+        assert(index.find(std::to_string(i))->second == i);
+    }
+    assert(!index.find("100"));
+    for(auto i = 0; i < 100; i += 2) {
+        assert(index.erase(std::to_string(i)));
+    }
+    assert(!index.erase("0"));
+    assert(index.size() == 50);
+    for(auto i = 0; i < 100; ++i) {
+        assert((index.find(std::to_string(i)) != nullptr) == (i % 2 == 1));
+    }
+    int sum = 0;
+    index.for_each([&](std::pair<std::string, int>& p) { sum += p.second; });
+    assert(sum == 2500);
+    index.clear();
+    assert(index.empty() && !index.find("1"));
+
+    // Insertions reuse erased slots, and the table grows as needed.
+    hash_index<std::string, std::pair<std::string, int>, first_of> large;
+    for(auto round = 0; round < 3; ++round) {
+        for(auto i = 0; i < 10000; ++i) {
+            large.insert({std::to_string(i), i});
+        }
+        for(auto i = 0; i < 10000; ++i) {
+            assert(large.find(std::to_string(i))->second == i);
+            assert(large.erase(std::to_string(i)));
+        }
+        assert(large.empty());
+    }
+
+    // Sized for a multi-million entry cache, the table must neither start out tiny
+    // nor rehash on every insertion.
+    const int huge_capacity = 22500000;
+    hash_index<uint16_t, uint16_t, identity> huge(huge_capacity);
+    const std::size_t huge_table_size = huge.table_size();
+    assert(huge_table_size >= std::size_t(huge_capacity));
+    for(auto i = 0; i < 1000; ++i) {
+        huge.insert(uint16_t(i));
+    }
+    assert(huge.table_size() == huge_table_size);
+    assert(huge.find(uint16_t(999)) && *huge.find(uint16_t(999)) == 999);
+}
+
+void test_string_keys()
+{
+    // Keys are hashed by std::hash, not by their bytes, so that equal strings share
+    // their frequency.
+    frequency_sketch<std::string> sketch(64);
+    for(auto i = 0; i < 5; ++i) {
+        sketch.record_access(std::string("key"));
+    }
+    assert(sketch.frequency(std::string("key")) == 5);
+
+    wtinylfu_cache<std::string, int> cache(100);
+    for(auto i = 0; i < 100; ++i) {
+        cache.insert(std::to_string(i), i);
+    }
+    std::vector<std::string> keys;
+    for(auto i = 0; i < 10; ++i) {
+        keys.push_back(std::to_string(i));
+    }
+    for(auto round = 0; round < 5; ++round) {
+        std::vector<std::shared_ptr<int>> values;
+        cache.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+        for(auto i = 0; i < 10; ++i) {
+            assert(values[i] && *values[i] == i);
+        }
+    }
+    // The frequently accessed keys survive a scan.
+    for(auto i = 100; i < 1000; ++i) {
+        cache.insert(std::to_string(i), i);
+    }
+    for(const auto& key : keys) {
+        assert(cache.contains(key));
+    }
+
+    // Sketches saved by earlier versions located counters by the keys' bytes, so
+    // their counters are discarded.
+    std::stringstream buffer;
+    sketch.save(buffer);
+    std::string bytes = buffer.str();
+    bytes[4] = 2;
+    std::stringstream old_buffer(bytes);
+    frequency_sketch<std::string> old(64);
+    old.load(old_buffer);
+    assert(old.hash_seed() == sketch.hash_seed());
+    assert(old.frequency(std::string("key")) == 0);
+}
+
 int main()
 {
 #define NUM_ENTRIES 1024
@@ -39,4 +1290,40 @@ int main()
     for(auto s = SELECTED_BEGIN; s < SELECTED_END; ++s) {
         assert(cache[s]);
     }
+
+    test_get_many();
+    test_get_all();
+    test_single_flight_load();
+    test_async_load();
+    test_refresh_after_write();
+    test_snapshot();
+    test_hints();
+    test_trace_recorder();
+    test_miss_ratio_curve();
+    test_shadow_caches();
+    test_capacity_controller();
+    test_sketch_resize();
+    test_incremental_shrink();
+    test_shrink_below_main<slru_policy>();
+    test_shrink_below_main<lru_policy>();
+    test_shrink_below_main<clock_policy>();
+    test_shrink_below_main<s3fifo_policy>();
+    test_deferred_reclamation();
+    test_removal_listener();
+    test_write_back();
+    test_eviction_policy<slru_policy>();
+    test_eviction_policy<lru_policy>();
+    test_eviction_policy<clock_policy>();
+    test_eviction_policy<s3fifo_policy>();
+    test_clock_window();
+    test_s3fifo_ghosts();
+    test_sampled_cache();
+    test_lazy_promotion();
+    test_admission<single_victim_admission>();
+    test_admission<coldest_of_admission<4>>();
+    test_admission<caffeine_admission>();
+    test_admission_victim_selection();
+    test_hash_flooding();
+    test_hash_index();
+    test_string_keys();
 }
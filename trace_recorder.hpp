@@ -0,0 +1,389 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef TRACE_RECORDER_HEADER
+#define TRACE_RECORDER_HEADER
+
+#include "snapshot.hpp"
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+/** A single access read back from a trace file by trace_reader. */
+struct trace_event
+{
+    uint32_t key_hash;
+    // Nanoseconds on the steady clock, if timestamps were recorded, 0 otherwise.
+    int64_t timestamp;
+    // Only meaningful if hits were recorded.
+    bool is_hit;
+};
+
+/**
+ * Records a stream of cache accesses to a compact binary trace file, for offline
+ * replay (see trace_reader), without slowing down the recording threads much.
+ *
+ * Only the key's hash is recorded, optionally with a timestamp and whether the
+ * access was a hit. Keys are sampled by hash, so either all or none of the accesses
+ * of a key are recorded and the trace keeps the reuse pattern of sampled keys.
+ *
+ * Each thread buffers its events in its own buffer, which is handed off to a
+ * background thread that encodes and writes them once full. Events buffered by
+ * threads other than the one destroying the recorder are written only if they
+ * were handed off (by a full buffer, flush, or the thread exiting) before that.
+ *
+ * File format: the "WTTR" magic, the format version and a flags byte (bit 0: has
+ * timestamps, bit 1: has hits), followed by one record per event: the key hash as 4
+ * raw bytes and, if either flag is set, a varint holding the zigzag encoded delta
+ * of the timestamp from the previous record's timestamp shifted left by one, with
+ * the hit bit in the lowest bit.
+ */
+class trace_recorder
+{
+public:
+    struct options
+    {
+        std::string path;
+
+        // The fraction of keys whose accesses are recorded, in (0, 1].
+        double sampling_rate = 1.0;
+
+        bool record_timestamps = false;
+        bool record_hits = false;
+
+        // The number of events a thread buffers before handing them off.
+        int buffer_size = 4096;
+    };
+
+    // "WTTR" when read as a little endian integer.
+    static constexpr uint32_t file_magic = 0x52545457;
+    static constexpr uint32_t file_version = 1;
+
+    static constexpr uint8_t has_timestamps_flag = 1;
+    static constexpr uint8_t has_hits_flag = 2;
+
+private:
+    struct event
+    {
+        uint32_t key_hash;
+        bool is_hit;
+        int64_t timestamp;
+    };
+
+    struct shared_state
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<std::vector<event>> pending;
+        uint64_t num_submitted = 0;
+        uint64_t num_written = 0;
+        bool is_stopped = false;
+    };
+
+    struct thread_buffer
+    {
+        // The id of the recorder owning this buffer, which is what's compared on the
+        // hot path; $owner is only locked to hand off the events.
+        uint64_t owner_id;
+        std::weak_ptr<shared_state> owner;
+        std::vector<event> events;
+
+        ~thread_buffer() { submit(owner.lock(), events); }
+    };
+
+    options options_;
+    uint32_t sampling_threshold_;
+    // Unique among all recorders created by the process, so that a thread's buffer
+    // is never mistaken for that of a later recorder at the same address.
+    uint64_t id_;
+    std::shared_ptr<shared_state> state_;
+    std::ofstream file_;
+    int64_t last_timestamp_ = 0;
+    std::thread writer_;
+
+public:
+    explicit trace_recorder(options opts)
+        : options_(std::move(opts))
+        , sampling_threshold_(sampling_threshold(options_.sampling_rate))
+        , id_(next_id())
+        , state_(std::make_shared<shared_state>())
+        , file_(options_.path, std::ios::binary | std::ios::trunc)
+    {
+        if(options_.buffer_size <= 0)
+        {
+            throw std::invalid_argument("trace buffer size must be greater than zero");
+        }
+        if(!file_) { throw std::runtime_error("could not open " + options_.path); }
+
+        snapshot::write_pod(file_, uint32_t(file_magic));
+        snapshot::write_pod(file_, uint32_t(file_version));
+        snapshot::write_pod(file_, flags());
+        writer_ = std::thread([this] { run_writer(); });
+    }
+
+    trace_recorder(const trace_recorder&) = delete;
+    trace_recorder& operator=(const trace_recorder&) = delete;
+
+    /** Writes the calling thread's and all handed off events, then closes the file. */
+    ~trace_recorder()
+    {
+        submit(state_, local_buffer().events);
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex);
+            state_->is_stopped = true;
+        }
+        state_->cond.notify_all();
+        writer_.join();
+    }
+
+    /** Returns whether accesses of the key with $key_hash are sampled. */
+    bool is_sampled(const uint32_t key_hash) const noexcept
+    {
+        return key_hash <= sampling_threshold_;
+    }
+
+    void record(const uint32_t key_hash, const bool is_hit)
+    {
+        if(!is_sampled(key_hash)) { return; }
+
+        int64_t timestamp = 0;
+        if(options_.record_timestamps)
+        {
+            timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        auto& buffer = local_buffer();
+        buffer.events.push_back({key_hash, is_hit, timestamp});
+        if(int(buffer.events.size()) >= options_.buffer_size)
+        {
+            submit(state_, buffer.events);
+        }
+    }
+
+    /**
+     * Hands off the calling thread's buffered events and blocks until they, and all
+     * previously handed off events, are written to the file.
+     */
+    void flush()
+    {
+        const uint64_t target = submit(state_, local_buffer().events);
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->cond.wait(lock, [this, target] { return state_->num_written >= target; });
+    }
+
+private:
+    static uint32_t sampling_threshold(const double rate)
+    {
+        if(rate <= 0 || rate > 1)
+        {
+            throw std::invalid_argument("trace sampling rate must be in (0, 1]");
+        }
+        return rate == 1 ? UINT32_MAX : uint32_t(rate * UINT32_MAX);
+    }
+
+    uint8_t flags() const noexcept
+    {
+        return (options_.record_timestamps ? has_timestamps_flag : 0)
+            | (options_.record_hits ? has_hits_flag : 0);
+    }
+
+    static uint64_t next_id() noexcept
+    {
+        static std::atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+    /**
+     * Returns the calling thread's buffer for this recorder. When a new buffer is
+     * created, those of recorders that no longer exist are dropped.
+     */
+    thread_buffer& local_buffer()
+    {
+        static thread_local std::vector<std::unique_ptr<thread_buffer>> buffers;
+        for(auto& buffer : buffers)
+        {
+            if(buffer->owner_id == id_) { return *buffer; }
+        }
+
+        buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+            [](const std::unique_ptr<thread_buffer>& buffer)
+            { return buffer->owner.expired(); }), buffers.end());
+        buffers.emplace_back(new thread_buffer);
+        buffers.back()->owner_id = id_;
+        buffers.back()->owner = state_;
+        buffers.back()->events.reserve(options_.buffer_size);
+        return *buffers.back();
+    }
+
+    /**
+     * Queues $events for writing and returns the sequence number that num_written
+     * reaches once they are written.
+     */
+    static uint64_t submit(const std::shared_ptr<shared_state>& state,
+        std::vector<event>& events)
+    {
+        if(state == nullptr) { return 0; }
+        uint64_t target;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if(!events.empty() && !state->is_stopped)
+            {
+                std::vector<event> batch;
+                batch.reserve(events.capacity());
+                batch.swap(events);
+                state->pending.push_back(std::move(batch));
+                ++state->num_submitted;
+            }
+            target = state->num_submitted;
+        }
+        state->cond.notify_all();
+        return target;
+    }
+
+    void run_writer()
+    {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        while(true)
+        {
+            state_->cond.wait(lock, [this]
+                { return !state_->pending.empty() || state_->is_stopped; });
+            if(state_->pending.empty()) { break; }
+
+            std::vector<event> batch = std::move(state_->pending.front());
+            state_->pending.pop_front();
+            lock.unlock();
+            write(batch);
+            file_.flush();
+            lock.lock();
+            ++state_->num_written;
+            state_->cond.notify_all();
+        }
+    }
+
+    void write(const std::vector<event>& events)
+    {
+        const bool has_extra = flags() != 0;
+        for(const auto& e : events)
+        {
+            snapshot::write_pod(file_, e.key_hash);
+            if(!has_extra) { continue; }
+
+            const int64_t delta = e.timestamp - last_timestamp_;
+            last_timestamp_ = e.timestamp;
+            const uint64_t zigzag = (uint64_t(delta) << 1) ^ uint64_t(delta >> 63);
+            write_varint(file_, (zigzag << 1) | (e.is_hit ? 1 : 0));
+        }
+    }
+
+    static void write_varint(std::ostream& out, uint64_t n)
+    {
+        while(n >= 0x80)
+        {
+            out.put(char(n | 0x80));
+            n >>= 7;
+        }
+        out.put(char(n));
+    }
+};
+
+/** Reads back the events of a trace file written by trace_recorder. */
+class trace_reader
+{
+    std::ifstream file_;
+    uint8_t flags_;
+    int64_t last_timestamp_ = 0;
+
+public:
+    explicit trace_reader(const std::string& path)
+        : file_(path, std::ios::binary)
+    {
+        if(!file_) { throw std::runtime_error("could not open " + path); }
+        if(snapshot::read_pod<uint32_t>(file_) != trace_recorder::file_magic
+           || snapshot::read_pod<uint32_t>(file_) != trace_recorder::file_version)
+        {
+            throw std::runtime_error("not a wtinylfu trace file");
+        }
+        flags_ = snapshot::read_pod<uint8_t>(file_);
+    }
+
+    bool has_timestamps() const noexcept
+    {
+        return flags_ & trace_recorder::has_timestamps_flag;
+    }
+
+    bool has_hits() const noexcept
+    {
+        return flags_ & trace_recorder::has_hits_flag;
+    }
+
+    /** Reads the next event into $e. Returns false at the end of the trace. */
+    bool next(trace_event& e)
+    {
+        uint32_t key_hash;
+        if(!file_.read(reinterpret_cast<char*>(&key_hash), sizeof key_hash))
+        {
+            return false;
+        }
+        e.key_hash = key_hash;
+        e.timestamp = 0;
+        e.is_hit = false;
+        if(flags_ == 0) { return true; }
+
+        const uint64_t n = read_varint();
+        const uint64_t zigzag = n >> 1;
+        const int64_t delta = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+        last_timestamp_ += delta;
+        e.timestamp = has_timestamps() ? last_timestamp_ : 0;
+        e.is_hit = n & 1;
+        return true;
+    }
+
+private:
+    uint64_t read_varint()
+    {
+        uint64_t n = 0;
+        for(auto shift = 0; shift < 64; shift += 7)
+        {
+            const int byte = file_.get();
+            if(byte == std::char_traits<char>::eof())
+            {
+                throw std::runtime_error("unexpected end of trace");
+            }
+            n |= uint64_t(byte & 0x7f) << shift;
+            if(!(byte & 0x80)) { return n; }
+        }
+        throw std::runtime_error("corrupt trace");
+    }
+};
+
+#endif
@@ -0,0 +1,148 @@
+/* Copyright 2017 https://github.com/mandreyel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies
+ * or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+ * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef WRITE_BACK_FLUSHER_HEADER
+#define WRITE_BACK_FLUSHER_HEADER
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * Writes back the dirty entries of a cache (see wtinylfu_cache::insert_dirty) in
+ * batches on a background thread.
+ *
+ * An entry is written back within $max_delay of becoming dirty: every $max_delay / 2
+ * the entries that have been dirty for at least that long are taken from the cache
+ * and handed to the writer in batches of at most $max_batch_size. All updates made to
+ * an entry in the meantime are thus coalesced into a single write, and the backing
+ * store sees a few large writes instead of one per update. Dirty entries that are
+ * evicted earlier are written back by the cache's flush callback instead.
+ *
+ * The writer is called from one thread at a time, without the cache's lock held.
+ * It must not throw (entries are marked clean when taken, so it should retry failed
+ * writes itself). NOTE: a newer value of an entry that is evicted while its older
+ * value is being written by the flusher may reach the flush callback first, so the
+ * backing store must order writes (e.g. by version) if that matters.
+ *
+ * $Cache is meant to be synchronized_wtinylfu_cache.
+ */
+template<typename Cache>
+class write_back_flusher
+{
+public:
+    using dirty_entry = typename Cache::dirty_entry;
+    using batch_writer = std::function<void(std::vector<dirty_entry> entries)>;
+
+    struct options
+    {
+        std::chrono::milliseconds max_delay = std::chrono::milliseconds(1000);
+        int max_batch_size = 256;
+    };
+
+private:
+    Cache& cache_;
+    options options_;
+    batch_writer writer_;
+
+    // Serializes calls to $writer_.
+    std::mutex write_mutex_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool is_stopped_ = false;
+    std::thread thread_;
+
+public:
+    write_back_flusher(Cache& cache, batch_writer writer, options opts)
+        : cache_(cache)
+        , options_(opts)
+        , writer_(std::move(writer))
+    {
+        if(options_.max_delay.count() <= 0)
+        {
+            throw std::invalid_argument("max delay must be greater than zero");
+        }
+        if(options_.max_batch_size <= 0)
+        {
+            throw std::invalid_argument("max batch size must be greater than zero");
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    write_back_flusher(Cache& cache, batch_writer writer)
+        : write_back_flusher(cache, std::move(writer), options())
+    {}
+
+    write_back_flusher(const write_back_flusher&) = delete;
+    write_back_flusher& operator=(const write_back_flusher&) = delete;
+
+    /** Stops the thread, then writes back all the remaining dirty entries. */
+    ~write_back_flusher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopped_ = true;
+        }
+        cond_.notify_one();
+        thread_.join();
+        flush();
+    }
+
+    /** Writes back all dirty entries on the calling thread. */
+    void flush()
+    {
+        flush(std::chrono::steady_clock::time_point::max());
+    }
+
+private:
+    void run()
+    {
+        // In the clock's own resolution, as halving whole milliseconds would round a
+        // 1ms delay down to a zero period and spin.
+        const auto period = std::chrono::steady_clock::duration(options_.max_delay) / 2;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(!cond_.wait_for(lock, period, [this] { return is_stopped_; }))
+        {
+            lock.unlock();
+            flush(std::chrono::steady_clock::now() - period);
+            lock.lock();
+        }
+    }
+
+    void flush(const std::chrono::steady_clock::time_point dirty_before)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        while(true)
+        {
+            auto entries = cache_.take_dirty_entries(dirty_before, options_.max_batch_size);
+            if(entries.empty()) { break; }
+            writer_(std::move(entries));
+        }
+    }
+};
+
+#endif
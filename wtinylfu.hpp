@@ -22,14 +22,42 @@
 #define WTINYLFU_HEADER
 
 #include "frequency_sketch.hpp"
+#include "eviction_policy.hpp"
+#include "admission_policy.hpp"
+#include "hash_index.hpp"
+#include "snapshot.hpp"
+#include "mapped_file.hpp"
+#include "trace_recorder.hpp"
+#include "miss_ratio_curve.hpp"
 #include "detail.hpp"
 
-#include <map>
 #include <list>
+#include <deque>
+#include <vector>
 #include <memory>
+#include <unordered_map>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
 #include <cmath>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 #include <cassert>
 
+template<
+    typename K,
+    typename V,
+    template<typename> class MainPolicy,
+    template<typename> class WindowSegment,
+    typename Admission
+> class synchronized_wtinylfu_cache;
+
 /**
  * Window-TinyLFU Cache as per: https://arxiv.org/pdf/1512.00727.pdf
  *
@@ -53,371 +81,1231 @@
  * cache's next victim based on TinyLFU's implementation defined historic frequency
  * filter. Currently a 4 bit frequency sketch is employed.
  *
+ * The window's share of the capacity is 1% by default, but may be configured.
+ *
+ * The main cache's eviction policy is SLRU by default, but may be any of those in
+ * eviction_policy.hpp ($MainPolicy), e.g. lru_policy, clock_policy or s3fifo_policy,
+ * while the window cache and the TinyLFU admission in front of it stay the same.
+ * Likewise, the window cache is an LRU by default, but may be a clock_segment
+ * ($WindowSegment). Combined with clock_policy (or s3fifo_policy), a hit then only
+ * sets a flag in the entry, instead of moving the entry to the front of a list.
+ * The admission rule is plain TinyLFU by default, but may be any of those in
+ * admission_policy.hpp ($Admission).
+ *
  * TinyLFU's periodic reset operation ensures that lingering entries that are no longer
  * accessed are evicted.
  *
  * Values are stored in shared_ptr<V> instances in order to ensure memory safety when
  * a cache entry is evicted while it is still being used by user.
  *
- * It is advised that trivially copiable, small keys be used as there persist two
- * copies of each within the cache.
+ * Keys are looked up in a hash_index, so they must be hashable with std::hash and
+ * comparable with ==. Each key is stored only once, in its entry, as the index
+ * refers to entries by position and compares keys through them. A key's std::hash
+ * is computed once per lookup and shared by the index and the frequency sketch.
+ *
+ * Against hash flooding, the frequency sketch (and s3fifo_policy's ghost queue)
+ * mix a random per-instance seed into the keys' std::hash, though keys with equal
+ * std::hash values still collide. The key hashes reported to the trace recorder,
+ * the miss ratio curve estimator and the shadow caches are not seeded, so that the
+ * traces of different caches are comparable; they don't affect which entries this
+ * cache keeps. Admission itself is deterministic, unless $Admission is
+ * caffeine_admission, the only policy that adds random jitter.
  *
- * NOTE: it is NOT thread-safe!
+ * NOTE: it is NOT thread-safe! See synchronized_wtinylfu_cache for that.
  */
 template<
     typename K,
-    typename V
+    typename V,
+    template<typename> class MainPolicy = slru_policy,
+    template<typename> class WindowSegment = lru_segment,
+    typename Admission = single_victim_admission
 > class wtinylfu_cache
 {
-    enum class cache_slot
+public:
+    /** Why an entry was removed from the cache, as reported to removal listeners. */
+    enum class removal_cause
+    {
+        // Evicted from the main cache, or due to a reduced capacity.
+        evicted,
+        // A window victim that lost the TinyLFU duel against the main cache's victim.
+        rejected,
+        // Removed by erase or clear.
+        erased,
+        // The entry's value was replaced by insert (the key is still cached).
+        replaced
+    };
+
+    using removal_listener = std::function<
+        void(const K& key, std::shared_ptr<V> value, removal_cause cause)>;
+
+    struct removal_notification
+    {
+        K key;
+        std::shared_ptr<V> value;
+        removal_cause cause;
+    };
+
+    enum class removal_delivery
     {
-        window,
-        probationary,
-        eden
+        // The listener is invoked by the call that removes the entry.
+        synchronous,
+        // Notifications are queued and delivered by deliver_removal_notifications.
+        batched
     };
 
+    using dirty_entry = std::pair<K, std::shared_ptr<V>>;
+    using flush_callback = std::function<void(const K& key, std::shared_ptr<V> value)>;
+
+private:
+    using cache_slot = detail::cache_slot;
+
     struct page
     {
+        using key_type = K;
+
+        // The small fields are kept next to each other (and to a small $key) so that
+        // they share the padding in front of $data.
         K key;
-        enum cache_slot cache_slot;
+        detail::cache_slot cache_slot;
+        // Used by the CLOCK based segments and policies (see eviction_policy.hpp).
+        uint8_t reference_count = 0;
         std::shared_ptr<V> data;
+        // Used by the LRU segments (see lru_segment::set_lazy_promotion).
+        uint32_t promoted_at = 0;
+        // Nonzero if $data has not yet been written back (see insert_dirty), in
+        // which case it's the generation of the entry's mark in $dirty_keys_.
+        uint32_t dirty_generation = 0;
 
-        page(K key_, enum cache_slot cache_slot_, std::shared_ptr<V> data_)
+        page(K key_, detail::cache_slot cache_slot_, std::shared_ptr<V> data_)
             : key(std::move(key_))
             , cache_slot(cache_slot_)
             , data(data_)
         {}
     };
 
-    class lru
+    using lru = lru_segment<page>;
+    using main_policy = MainPolicy<page>;
+    using window_segment = WindowSegment<page>;
+    using shadow_cache_type = wtinylfu_cache<
+        uint32_t, detail::empty, MainPolicy, WindowSegment, Admission>;
+
+    // The fraction of the total capacity allocated to the window cache.
+    float window_ratio_;
+
+    frequency_sketch<K> filter_;
+
+    struct page_key
     {
-        std::list<page> lru_;
-        int capacity_;
+        const K& operator()(const typename lru::page_position& page) const noexcept
+        {
+            return page->key;
+        }
+    };
+
+    // Maps keys to page positions of the LRU caches pointing to a page. The keys are
+    // not copied into the index but are compared through the positions, so a page
+    // must be erased from the index before it's erased from its segment.
+    hash_index<K, typename lru::page_position, page_key> page_map_;
 
-    public:
-        using page_position = typename std::list<page>::iterator;
-        using const_page_position = typename std::list<page>::const_iterator;
+    // Allocated 1% of the total capacity by default. Window victims are granted the
+    // chance to reenter the cache (into $main_). This is to remediate the problem
+    // where sparse bursts cause repeated misses in the regular TinyLfu architecture.
+    window_segment window_;
 
-        explicit lru(int capacity) : capacity_(capacity) {}
+    // Allocated the rest (99% by default) of the total capacity.
+    main_policy main_;
 
-        int size() const noexcept { return lru_.size(); }
-        int capacity() const noexcept { return capacity_; }
-        bool is_full() const noexcept { return size() >= capacity(); }
+    Admission admission_;
 
-        /**
-         * NOTE: doesn't actually remove any pages, it only sets the capacity.
-         *
-         * This is because otherwise there'd be no way to delete the corresponding
-         * entries from the page map outside of this LRU instance, so this is handled
-         * externally.
-         */
-        void set_capacity(const int n) noexcept { capacity_ = n; }
+    // Statistics.
+    int num_cache_hits_ = 0;
+    int num_cache_misses_ = 0;
 
-        /** Returns the position of the hottest (most recently used) page. */
-        page_position mru_pos() noexcept { return lru_.begin(); }
-        const_page_position mru_pos() const noexcept { return lru_.begin(); }
+    // If set, lookups are recorded in an access trace.
+    std::shared_ptr<trace_recorder> trace_recorder_;
 
-        /** Returns the position of the coldest (least recently used) page. */
-        page_position lru_pos() noexcept { return --lru_.end(); }
-        const_page_position lru_pos() const noexcept { return --lru_.end(); }
+    // If set, lookups are fed to a miss ratio curve estimator.
+    std::shared_ptr<miss_ratio_curve_estimator> mrc_estimator_;
 
-        const K& victim_key() const noexcept
+    // If set, the values of evicted entries are moved to $reclaim_queue_ rather than
+    // released (and possibly destroyed) by the thread doing the eviction.
+    bool defer_reclamation_ = false;
+    std::vector<std::shared_ptr<V>> reclaim_queue_;
+
+    // Notified of every removed entry, if set.
+    removal_listener removal_listener_;
+    removal_delivery removal_delivery_ = removal_delivery::synchronous;
+    std::vector<removal_notification> removal_notifications_;
+
+    // Called with each dirty entry that is removed from the cache.
+    flush_callback flush_callback_;
+
+    struct dirty_mark
+    {
+        K key;
+        uint32_t generation;
+        std::chrono::steady_clock::time_point dirty_since;
+    };
+
+    // The keys of dirty entries, in the order in which they became dirty, along with
+    // when they did. Marks whose entry has since been cleaned (and possibly dirtied
+    // again, under a new generation) are stale, and are skipped by
+    // take_dirty_entries.
+    std::deque<dirty_mark> dirty_keys_;
+    uint32_t last_dirty_generation_ = 0;
+    int num_dirty_ = 0;
+
+    /**
+     * A metadata-only cache with an alternative configuration, fed a sample of the
+     * keys looked up in this cache, to measure the hit ratio this cache would have
+     * if it were configured that way. Keys are represented by their hashes.
+     */
+    struct shadow_cache
+    {
+        std::shared_ptr<shadow_cache_type> cache;
+        int capacity;
+        float window_ratio;
+        // Keys whose mixed hash is below this are fed to $cache.
+        uint64_t sampling_threshold;
+        double sampling_rate;
+    };
+
+    std::vector<shadow_cache> shadow_caches_;
+
+    friend class synchronized_wtinylfu_cache<
+        K, V, MainPolicy, WindowSegment, Admission>;
+    template<
+        typename,
+        typename,
+        template<typename> class,
+        template<typename> class,
+        typename
+    > friend class wtinylfu_cache;
+
+public:
+    /**
+     * The hit statistics of a shadow cache, which are those that this cache would
+     * have if it were configured with $capacity and $window_ratio (as estimated from
+     * a sample of the accesses, see add_shadow_cache).
+     */
+    struct shadow_cache_stats
+    {
+        int capacity;
+        float window_ratio;
+        double sampling_rate;
+        int num_cache_hits;
+        int num_cache_misses;
+
+        double hit_ratio() const noexcept
         {
-            return lru_pos()->key;
+            const int num_accesses = num_cache_hits + num_cache_misses;
+            return num_accesses > 0 ? double(num_cache_hits) / num_accesses : 0;
         }
+    };
 
-        void evict()
+    /**
+     * $window_ratio is the fraction of $capacity allocated to the window cache. The
+     * default of 1% works well for most workloads, while recency skewed workloads
+     * benefit from a larger window.
+     */
+    explicit wtinylfu_cache(int capacity, float window_ratio = 0.01f)
+        : window_ratio_(window_ratio)
+        , filter_(capacity)
+        , page_map_(capacity)
+        , window_(window_capacity(capacity))
+        , main_(capacity - window_.capacity())
+    {
+        if(window_ratio <= 0 || window_ratio >= 1)
         {
-            erase(lru_pos());
+            throw std::invalid_argument("window ratio must be in (0, 1)");
         }
-
-        void erase(page_position page)
+        if(capacity < min_capacity(window_ratio))
         {
-            lru_.erase(page);
+            throw std::invalid_argument("cache capacity must leave room for the main cache");
         }
+    }
+
+    /**
+     * Returns the smallest capacity that leaves at least one entry for the main
+     * cache next to the window cache with $window_ratio, which is 2 unless the
+     * window takes up most of the cache.
+     */
+    static int min_capacity(const float window_ratio) noexcept
+    {
+        int n = 2;
+        while(n - window_capacity(n, window_ratio) < 1) { ++n; }
+        return n;
+    }
+
+    int size() const noexcept
+    {
+        return window_.size() + main_.size();
+    }
+
+    int capacity() const noexcept
+    {
+        return window_.capacity() + main_.capacity();
+    }
+
+    int num_cache_hits() const noexcept { return num_cache_hits_; }
+    int num_cache_misses() const noexcept { return num_cache_misses_; }
+
+    bool contains(const K& key) const noexcept
+    {
+        return page_map_.find(key) != nullptr;
+    }
 
-        /** Inserts new page at the MRU position of the cache. */
-        template<typename... Args>
-        page_position insert(Args&&... args)
+    /**
+     * Records the key hash (and whether it was a hit) of every subsequent lookup by
+     * get, get_many and the methods built on them with $recorder. Pass null to stop
+     * recording. The same recorder may be shared by several caches, as the key hash
+     * (detail::fold_hash of the key's std::hash) is not seeded.
+     */
+    void set_trace_recorder(std::shared_ptr<trace_recorder> recorder)
+    {
+        trace_recorder_ = std::move(recorder);
+    }
+
+    /**
+     * Feeds every subsequent lookup by get, get_many and the methods built on them
+     * to $estimator, whose estimate is then reported by miss_ratio_curve. Pass null
+     * to stop estimating.
+     */
+    void set_miss_ratio_curve_estimator(
+        std::shared_ptr<miss_ratio_curve_estimator> estimator)
+    {
+        mrc_estimator_ = std::move(estimator);
+    }
+
+    /**
+     * Returns the estimated miss ratio at a range of capacities as (capacity, miss
+     * ratio) pairs, or nothing if no estimator is set (see
+     * miss_ratio_curve_estimator).
+     */
+    std::vector<std::pair<int, double>> miss_ratio_curve() const
+    {
+        if(mrc_estimator_) { return mrc_estimator_->curve(); }
+        return {};
+    }
+
+    /**
+     * Runs a shadow cache alongside this one, which simulates how this cache would
+     * perform with $capacity and $window_ratio, without storing any values. Its
+     * statistics are reported by shadow_caches.
+     *
+     * To keep the overhead low, only the accesses of a $sampling_rate fraction of
+     * keys (sampled by hash) are fed to a shadow cache whose capacity is scaled down
+     * by the same fraction, which estimates the hit ratio of the full size cache
+     * (see SHARDS in miss_ratio_curve.hpp).
+     */
+    void add_shadow_cache(const int capacity, const float window_ratio = 0.01f,
+        const double sampling_rate = 0.01)
+    {
+        if(capacity <= 0)
         {
-            return lru_.emplace(mru_pos(), std::forward<Args>(args)...);
+            throw std::invalid_argument("cache capacity must be greater than zero");
+        }
+        if(sampling_rate <= 0 || sampling_rate > 1)
+        {
+            throw std::invalid_argument("sampling rate must be in (0, 1]");
         }
 
-        /** Moves page to the MRU position. */
-        void handle_hit(page_position page)
+        if(window_ratio <= 0 || window_ratio >= 1)
         {
-            transfer_page_from(page, *this);
+            throw std::invalid_argument("window ratio must be in (0, 1)");
         }
 
-        /** Moves page from $source to the MRU position of this cache. */
-        void transfer_page_from(page_position page, lru& source)
+        // A small enough capacity or sampling rate would otherwise leave the shadow
+        // cache without room for its main cache.
+        const int scaled_capacity = std::max(min_capacity(window_ratio),
+            int(std::round(capacity * sampling_rate)));
+        shadow_cache shadow;
+        shadow.cache = std::make_shared<shadow_cache_type>(scaled_capacity, window_ratio);
+        shadow.capacity = capacity;
+        shadow.window_ratio = window_ratio;
+        shadow.sampling_threshold = uint64_t(sampling_rate * (uint64_t(1) << 32));
+        shadow.sampling_rate = sampling_rate;
+        shadow_caches_.push_back(std::move(shadow));
+    }
+
+    std::vector<shadow_cache_stats> shadow_caches() const
+    {
+        std::vector<shadow_cache_stats> stats;
+        for(const auto& shadow : shadow_caches_)
         {
-            lru_.splice(mru_pos(), source.lru_, page);
+            stats.push_back({shadow.capacity, shadow.window_ratio, shadow.sampling_rate,
+                shadow.cache->num_cache_hits(), shadow.cache->num_cache_misses()});
         }
-    };
+        return stats;
+    }
+
+    void clear_shadow_caches()
+    {
+        shadow_caches_.clear();
+    }
 
     /**
-     * A cache which is divided into two segments, a probationary and an eden
-     * segment. Both are LRU caches.
-     *
-     * Pages that are cache hits are promoted to the top (MRU position) of the eden
-     * segment, regardless of the segment in which they currently reside. Thus, pages
-     * within the eden segment have been accessed at least twice.
+     * If enabled, the values of evicted entries are not released by the evicting call
+     * (an insertion or a capacity change), where destroying large values would add
+     * to its latency, but are queued up instead. The queue must then be drained,
+     * either in bounded batches with reclaim, or wholesale by handing it to another
+     * thread with take_reclaimable (see background_reclaimer).
      *
-     * Pages that are cache misses are added to the cache at the MRU position of the
-     * probationary segment.
+     * Disabling it doesn't release the values that are already queued.
+     */
+    void set_deferred_reclamation(const bool enabled) noexcept
+    {
+        defer_reclamation_ = enabled;
+    }
+
+    int num_reclaimable() const noexcept
+    {
+        return reclaim_queue_.size();
+    }
+
+    /**
+     * Releases at most $max_values of the queued values of evicted entries. Returns
+     * the number of released values.
+     */
+    int reclaim(const int max_values)
+    {
+        const int n = std::min(std::max(max_values, 0), num_reclaimable());
+        reclaim_queue_.erase(reclaim_queue_.end() - n, reclaim_queue_.end());
+        return n;
+    }
+
+    /**
+     * Sets the listener that is notified of the key, value and cause of each entry
+     * removed from the cache (pass an empty function to unset it).
      *
-     * Each segment is finite in size, so the migration of a page from the probationary
-     * segment may force the LRU page of the eden segment into the MRU position of
-     * the probationary segment, giving it another chance. Likewise, if both segments
-     * reach their capacity, a new entry is replaced with the LRU victim of the
-     * probationary segment.
+     * With synchronous delivery, the listener is invoked while the cache is being
+     * modified, so it must not access the cache. With batched delivery, the
+     * notifications are queued instead (keeping the removed values alive) and are
+     * delivered by deliver_removal_notifications (or handed over with
+     * take_removal_notifications), e.g. periodically or from a background thread,
+     * which keeps the listener off the eviction path.
+     */
+    void set_removal_listener(removal_listener listener,
+        const removal_delivery delivery = removal_delivery::synchronous)
+    {
+        removal_listener_ = std::move(listener);
+        removal_delivery_ = delivery;
+    }
+
+    /** Invokes the removal listener with each queued notification, in order. */
+    void deliver_removal_notifications()
+    {
+        auto notifications = take_removal_notifications();
+        if(!removal_listener_) { return; }
+        for(auto& n : notifications)
+        {
+            removal_listener_(n.key, std::move(n.value), n.cause);
+        }
+    }
+
+    /** Returns (and removes) the queued notifications. */
+    std::vector<removal_notification> take_removal_notifications() noexcept
+    {
+        std::vector<removal_notification> notifications;
+        notifications.swap(removal_notifications_);
+        return notifications;
+    }
+
+    /**
+     * Sets the callback that writes back dirty entries (see insert_dirty) when they
+     * are removed from the cache for any reason other than being replaced, i.e. when
+     * evicted (also by change_capacity), rejected, erased or cleared. It's invoked
+     * while the cache is being modified, so it must not access the cache.
+     */
+    void set_flush_callback(flush_callback callback)
+    {
+        flush_callback_ = std::move(callback);
+    }
+
+    /** Returns the number of entries that have not yet been written back. */
+    int num_dirty() const noexcept { return num_dirty_; }
+
+    /**
+     * Returns at most $max_entries of the entries that became dirty before
+     * $dirty_before, in the order in which they did, and marks them clean. The
+     * caller is then responsible for writing them back, e.g. in a single batch (see
+     * write_back_flusher).
      *
-     * In this implementation 80% of the capacity is allocated to the eden (or "hot")
-     * pages and 20% for pages under probation (the "cold" pages).
+     * An entry that is updated several times while dirty is written back only once,
+     * with its latest value.
      */
-    class slru
+    std::vector<dirty_entry> take_dirty_entries(
+        const std::chrono::steady_clock::time_point dirty_before
+            = std::chrono::steady_clock::time_point::max(),
+        const int max_entries = INT_MAX)
     {
-        lru eden_;
-        lru probationary_;
+        std::vector<dirty_entry> entries;
+        while(!dirty_keys_.empty() && int(entries.size()) < max_entries
+            && dirty_keys_.front().dirty_since < dirty_before)
+        {
+            const auto mark = std::move(dirty_keys_.front());
+            dirty_keys_.pop_front();
+            if(!is_live(mark)) { continue; }
 
-    public:
-        using page_position = typename lru::page_position;
-        using const_page_position = typename lru::const_page_position;
+            auto page = *page_map_.find(mark.key);
+            mark_clean(page);
+            entries.emplace_back(page->key, page->data);
+        }
+        return entries;
+    }
 
-        explicit slru(int capacity) : slru(0.8f * capacity, capacity - 0.8f * capacity)
+    /** Returns (and removes) all the queued values of evicted entries. */
+    std::vector<std::shared_ptr<V>> take_reclaimable() noexcept
+    {
+        std::vector<std::shared_ptr<V>> values;
+        values.swap(reclaim_queue_);
+        return values;
+    }
+
+    /**
+     * Enables lazy promotion if $fraction is in (0, 1], or disables it (the default)
+     * if it's 0: a hit on an entry that is still among the most recently promoted
+     * $fraction of its LRU segment (the window, or eden with SLRU) doesn't move the
+     * entry to the segment's MRU position. This saves most of the list writes of
+     * hits on hot entries at little cost in hit ratio, since the order of the colder
+     * entries, from which victims are picked, is preserved.
+     */
+    void set_lazy_promotion(const float fraction)
+    {
+        if(fraction < 0 || fraction > 1)
         {
-            // correct truncation error
-            if(this->capacity() < capacity)
-            {
-                eden_.set_capacity(eden_.capacity() + 1);
-            }
+            throw std::invalid_argument("lazy promotion fraction must be in [0, 1]");
         }
+        window_.set_lazy_promotion(fraction);
+        main_.set_lazy_promotion(fraction);
+    }
 
-        slru(int eden_capacity, int probationary_capacity)
-            : eden_(eden_capacity)
-            , probationary_(probationary_capacity)
-        {}
+    /**
+     * The frequency sketch is resized along with the cache, preserving the access
+     * history gathered so far (see frequency_sketch::change_capacity).
+     */
+    void change_capacity(const int n)
+    {
+        if(n < min_capacity(window_ratio_))
+        {
+            throw std::invalid_argument("cache capacity must leave room for the main cache");
+        }
 
-        const int size() const noexcept
+        filter_.change_capacity(n);
+        window_.set_capacity(window_capacity(n));
+        main_.set_capacity(n - window_.capacity());
+
+        // Only evict what is over the new capacity: a segment at capacity, and in
+        // particular an empty main segment of capacity zero, is left alone.
+        while(window_.size() > window_.capacity())
         {
-            return eden_.size() + probationary_.size();
+            evict_from_window(removal_cause::evicted);
         }
+        while(main_.size() > main_.capacity()) { evict_from_main(); }
+    }
 
-        const int capacity() const noexcept
+    /**
+     * Same as change_capacity, except that when shrinking, the entries over the new
+     * capacity are not all evicted by this call, which could take long for large
+     * caches. Instead, the new capacity takes effect right away for admission, while
+     * the excess entries are evicted a few at a time by each subsequent insertion,
+     * and may also be evicted in bounded batches with evict_excess, e.g. by a
+     * maintenance task.
+     */
+    void change_capacity_incrementally(const int n)
+    {
+        if(n < min_capacity(window_ratio_))
         {
-            return eden_.capacity() + probationary_.capacity();
+            throw std::invalid_argument("cache capacity must leave room for the main cache");
         }
 
-        const bool is_full() const noexcept
+        filter_.change_capacity(n);
+        window_.set_capacity(window_capacity(n));
+        main_.set_capacity(n - window_.capacity());
+    }
+
+    /** Returns the number of entries over capacity after an incremental shrink. */
+    int num_excess_entries() const noexcept
+    {
+        return std::max(0, window_.size() - window_.capacity())
+            + std::max(0, main_.size() - main_.capacity());
+    }
+
+    /**
+     * Evicts at most $max_evictions of the entries over capacity (see
+     * change_capacity_incrementally). Returns the number of evicted entries.
+     */
+    int evict_excess(const int max_evictions)
+    {
+        int num_evicted = 0;
+        for(; num_evicted < max_evictions && window_.size() > window_.capacity();
+            ++num_evicted)
         {
-            return size() >= capacity();
+            evict_from_window(removal_cause::evicted);
         }
+        for(; num_evicted < max_evictions && main_.size() > main_.capacity();
+            ++num_evicted)
+        {
+            evict_from_main();
+        }
+        return num_evicted;
+    }
+
+    std::shared_ptr<V> get(const K& key)
+    {
+        const std::size_t key_hash = page_map_.key_hash(key);
+        filter_.record_access_by_hash(filter_.hash_of(key_hash));
+        return lookup(key, key_hash);
+    }
+
+    /**
+     * Equivalent to calling get on each key in [$first, $last) and writing the
+     * results, in order, to $out.
+     *
+     * Keys are processed in small batches: all keys in a batch are hashed and their
+     * frequency sketch blocks and index slots are prefetched before any of the
+     * lookups are resolved, so that the cache misses overlap rather than being taken
+     * one by one.
+     */
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt get_many(ForwardIt first, ForwardIt last, OutputIt out)
+    {
+        static constexpr int batch_size = 16;
+        std::size_t key_hashes[batch_size];
+        uint32_t hashes[batch_size];
 
-        void set_capacity(const int n)
+        while(first != last)
         {
-            eden_.set_capacity(0.8f * n);
-            probationary_.set_capacity(n - eden_.capacity());
+            auto batch_first = first;
+            int n = 0;
+            for(; first != last && n < batch_size; ++first, ++n)
+            {
+                key_hashes[n] = page_map_.key_hash(*first);
+                hashes[n] = filter_.hash_of(key_hashes[n]);
+                filter_.prefetch(hashes[n]);
+                page_map_.prefetch(key_hashes[n]);
+            }
+
+            for(auto i = 0; i < n; ++i, ++batch_first)
+            {
+                filter_.record_access_by_hash(hashes[i]);
+                *out++ = lookup(*batch_first, key_hashes[i]);
+            }
         }
+        return out;
+    }
 
-        page_position victim_pos() noexcept
+    std::shared_ptr<V> operator[](const K& key)
+    {
+        return get(key);
+    }
+
+    /**
+     * Returns the value associated with $key, if any, without recording an access,
+     * i.e. without affecting the eviction order, the frequency sketch or the
+     * statistics.
+     */
+    std::shared_ptr<V> peek(const K& key) const
+    {
+        auto page = page_map_.find(key);
+        if(page != nullptr)
         {
-            return probationary_.lru_pos();
+            return (*page)->data;
         }
+        return nullptr;
+    }
 
-        const_page_position victim_pos() const noexcept
+    template<typename ValueLoader>
+    std::shared_ptr<V> get_and_insert_if_missing(const K& key, ValueLoader value_loader)
+    {
+        std::shared_ptr<V> value = get(key);
+        if(value == nullptr)
         {
-            return probationary_.lru_pos();
+            value = std::make_shared<V>(value_loader(key));
+            insert(key, value);
         }
+        return value;
+    }
 
-        const K& victim_key() const noexcept
+    /**
+     * Returns the values of all $keys, in the order of $keys.
+     *
+     * Keys that are not in the cache are collected (without duplicates) and passed
+     * in a single call to $bulk_loader, which must return a container with the
+     * values of those keys in the same order. The loaded values are then inserted
+     * in one pass, evicting from the window only once all of them are in.
+     */
+    template<typename BulkLoader>
+    std::vector<std::shared_ptr<V>> get_all(
+        const std::vector<K>& keys, BulkLoader bulk_loader)
+    {
+        std::vector<std::shared_ptr<V>> values;
+        values.reserve(keys.size());
+        get_many(keys.begin(), keys.end(), std::back_inserter(values));
+
+        // Maps each missing key to its index in $missing_keys.
+        std::unordered_map<K, int> missing_index;
+        std::vector<K> missing_keys;
+        for(auto i = 0; i < int(keys.size()); ++i)
         {
-            return victim_pos()->key;
+            if(values[i] == nullptr
+               && missing_index.emplace(keys[i], missing_keys.size()).second)
+            {
+                missing_keys.push_back(keys[i]);
+            }
         }
+        if(missing_keys.empty()) { return values; }
 
-        void evict()
+        auto loaded = bulk_loader(missing_keys);
+        if(loaded.size() != missing_keys.size())
         {
-            probationary_.evict();
+            throw std::runtime_error("bulk loader must return a value for each key");
         }
 
-        void erase(page_position page)
+        std::vector<std::shared_ptr<V>> loaded_values;
+        loaded_values.reserve(loaded.size());
+        for(auto& value : loaded)
         {
-            if(page->cache_slot == cache_slot::eden)
-                eden_.erase(page);
-            else
-                probationary_.erase(page);
+            loaded_values.push_back(std::make_shared<V>(std::move(value)));
         }
+        insert_batch(missing_keys, loaded_values);
 
-        /** Moves page to the MRU position of the probationary segment. */
-        void transfer_page_from(page_position page, lru& source)
+        for(auto i = 0; i < int(keys.size()); ++i)
         {
-            probationary_.transfer_page_from(page, source);
-            page->cache_slot = cache_slot::probationary;
+            if(values[i] == nullptr)
+            {
+                values[i] = loaded_values[missing_index[keys[i]]];
+            }
         }
+        return values;
+    }
 
-        /**
-         * If page is in the probationary segment:
-         * promotes page to the MRU position of the eden segment, and if eden segment
-         * capacity is reached, moves the LRU page of the eden segment to the MRU
-         * position of the probationary segment.
-         *
-         * Otherwise, page is in eden:
-         * promotes page to the MRU position of eden.
-         */
-        void handle_hit(page_position page)
+    void insert(K key, V value)
+    {
+        insert(std::move(key), std::make_shared<V>(std::move(value)));
+    }
+
+    /**
+     * Inserts an entry, like insert, but marks it dirty: its value is yet to be
+     * written to the backing store, which is done either when the entry is removed
+     * (see set_flush_callback) or when it's taken with take_dirty_entries, whichever
+     * comes first. Writes to an entry that is still dirty are thus coalesced.
+     *
+     * Inserting a key with insert instead marks its entry clean, discarding a pending
+     * write back, as the value is then assumed to come from the backing store.
+     */
+    void insert_dirty(K key, V value)
+    {
+        insert(std::move(key), std::make_shared<V>(std::move(value)), true);
+    }
+
+    /** Removes all entries, but keeps the frequency sketch and the statistics. */
+    void clear()
+    {
+        page_map_.for_each([this](typename lru::page_position& page)
+            { retire(page, removal_cause::erased); });
+        page_map_.clear();
+        dirty_keys_.clear();
+        window_.clear();
+        main_.clear();
+    }
+
+    /**
+     * Writes the cache's entries to $out, such that they can be restored (e.g. after
+     * a restart) by load_snapshot. The snapshot records the segment of each entry
+     * and its position within the segment. Keys and values are written by $codec
+     * (see snapshot::trivial_codec for its interface).
+     *
+     * The format is a versioned header followed by the eden, probationary and window
+     * segments, each as the number of its entries and the entries from MRU to LRU,
+     * and finally the frequency sketch (see frequency_sketch::save).
+     */
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    void save_snapshot(std::ostream& out, const Codec& codec = Codec()) const
+    {
+        snapshot::write_header(out);
+        save_segment(out, main_.eden(), codec);
+        save_segment(out, main_.probationary(), codec);
+        save_segment(out, window_, codec);
+        filter_.save(out);
+    }
+
+    /**
+     * Replaces the cache's entries with those in the snapshot read from $in, which
+     * was written by save_snapshot with an equivalent $codec. The entries are read
+     * one by one, so the snapshot is streamed rather than loaded into memory.
+     *
+     * Each entry is restored into its original segment and position. If this cache
+     * is smaller than the one that was saved, eden and window entries that don't
+     * fit their segment are moved to the probationary segment if there is room
+     * there, and dropped otherwise (the coldest entries being dropped first).
+     *
+     * The frequency sketch is restored as well, so admission decisions are as good as
+     * they were before the snapshot was taken, and resized to this cache's capacity.
+     */
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    void load_snapshot(std::istream& in, const Codec& codec = Codec())
+    {
+        snapshot::read_header(in);
+        clear();
+        load_segment(in, cache_slot::eden, codec);
+        load_segment(in, cache_slot::probationary, codec);
+        load_segment(in, cache_slot::window, codec);
+        filter_.load(in);
+        filter_.change_capacity(capacity());
+    }
+
+    /**
+     * Writes a snapshot of the cache to the file at $path, to be restored with
+     * load_snapshot_file.
+     *
+     * If both keys and values are trivially copyable (and the platform supports
+     * memory mapping), the memory mappable layout described by
+     * snapshot::mapped_header is used and $codec is ignored. Otherwise this is the
+     * same as save_snapshot into the file.
+     *
+     * The snapshot is written to a temporary file next to $path, which then
+     * replaces $path by renaming. The file at $path is thus never modified in place,
+     * which matters if it was loaded with load_snapshot_file, as values may still
+     * point into its mapping.
+     */
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    void save_snapshot_file(const std::string& path, const Codec& codec = Codec()) const
+    {
+        const std::string temp_path = path + ".tmp";
         {
-            if(page->cache_slot == cache_slot::probationary)
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            if(!out) { throw std::runtime_error("could not open " + temp_path); }
+            try
             {
-                promote_to_eden(page);
-                if(eden_.is_full()) { demote_to_probationary(eden_.lru_pos()); }
+                save_snapshot_file(out, codec, is_mappable());
+                out.close();
+                if(!out) { throw std::runtime_error("could not write " + temp_path); }
             }
-            else
+            catch(...)
             {
-                assert(page->cache_slot == cache_slot::eden); // this shouldn't happen
-                eden_.handle_hit(page);
+                out.close();
+                std::remove(temp_path.c_str());
+                throw;
             }
         }
+        if(std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("could not replace " + path);
+        }
+    }
 
-    private:
-        void promote_to_eden(page_position page)
+    /**
+     * Restores a snapshot written by save_snapshot_file with the same key and value
+     * types (see load_snapshot for how entries are placed).
+     *
+     * With the memory mappable layout, the file is mapped rather than read: the
+     * values are not copied but used in place (each cached value points into the
+     * mapping, which is unmapped when the last such value is gone), so only the
+     * index is built up front and value pages are read from disk on first access.
+     */
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    void load_snapshot_file(const std::string& path, const Codec& codec = Codec())
+    {
+        load_snapshot_file(path, codec, is_mappable());
+    }
+
+    /**
+     * Writes "warm hints" to $out: the keys of the (at most $max_keys) hottest
+     * entries, along with their estimated frequencies and segments, but without
+     * their values. Entries are ranked by frequency, ties being broken in favor of
+     * eden, then probationary, then window entries. Keys are written by $codec's
+     * write_key (see snapshot::trivial_codec).
+     *
+     * Unlike a snapshot, hints are small and contain no values, so they can be kept
+     * even where values can't be, and are restored with load_hints.
+     */
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    void save_hints(std::ostream& out, const int max_keys, const Codec& codec = Codec()) const
+    {
+        struct hint
+        {
+            const page* p;
+            int frequency;
+            int rank;
+        };
+
+        std::vector<hint> hints;
+        hints.reserve(size());
+        const lru* segments[] = { &main_.eden(), &main_.probationary(), &window_ };
+        for(auto rank = 0; rank < 3; ++rank)
         {
-            eden_.transfer_page_from(page, probationary_);
-            page->cache_slot = cache_slot::eden;
+            for(const auto& page : *segments[rank])
+            {
+                hints.push_back({&page, filter_.frequency(page.key), rank});
+            }
         }
 
-        void demote_to_probationary(page_position page)
+        const auto num_hints = std::min<std::size_t>(std::max(max_keys, 0), hints.size());
+        std::partial_sort(hints.begin(), hints.begin() + num_hints, hints.end(),
+            [](const hint& a, const hint& b)
+            {
+                return a.frequency > b.frequency
+                    || (a.frequency == b.frequency && a.rank < b.rank);
+            });
+
+        snapshot::write_pod(out, snapshot::hints_magic);
+        snapshot::write_pod(out, snapshot::hints_version);
+        snapshot::write_pod(out, uint64_t(num_hints));
+        for(std::size_t i = 0; i < num_hints; ++i)
         {
-            probationary_.transfer_page_from(page, eden_);
-            page->cache_slot = cache_slot::probationary;
+            codec.write_key(out, hints[i].p->key);
+            snapshot::write_pod(out, uint8_t(hints[i].frequency));
+            snapshot::write_pod(out, uint8_t(hints[i].p->cache_slot));
         }
-    };
+        if(!out) { throw std::runtime_error("could not write hints"); }
+    }
 
-    frequency_sketch<K> filter_;
+    /**
+     * Reads hints written by save_hints and seeds the frequency sketch with their
+     * frequencies, so that admission decisions favor previously hot keys right away.
+     * Returns the hinted keys, hottest first, e.g. to be loaded ahead of demand with
+     * get_all (or synchronized_wtinylfu_cache::prefetch).
+     */
+    template<typename Codec = snapshot::trivial_codec<K, V>>
+    std::vector<K> load_hints(std::istream& in, const Codec& codec = Codec())
+    {
+        if(snapshot::read_pod<uint32_t>(in) != snapshot::hints_magic
+           || snapshot::read_pod<uint32_t>(in) != snapshot::hints_version)
+        {
+            throw std::runtime_error("not a wtinylfu hints file");
+        }
 
-    // Maps keys to page positions of the LRU caches pointing to a page.
-    std::map<K, typename lru::page_position> page_map_;
+        const auto num_hints = snapshot::read_pod<uint64_t>(in);
+        std::vector<K> keys;
+        for(uint64_t i = 0; i < num_hints; ++i)
+        {
+            K key = codec.read_key(in);
+            const int frequency = snapshot::read_pod<uint8_t>(in);
+            // The segment is currently only informative.
+            snapshot::read_pod<uint8_t>(in);
+            filter_.seed(key, frequency);
+            keys.push_back(std::move(key));
+        }
+        return keys;
+    }
 
-    // Allocated 1% of the total capacity. Window victims are granted the chance to
-    // reenter the cache (into $main_). This is to remediate the problem where sparse
-    // bursts cause repeated misses in the regular TinyLfu architecture.
-    lru window_;
+    void erase(const K& key)
+    {
+        auto it = page_map_.find(key);
+        if(it != nullptr)
+        {
+            auto page = *it;
+            retire(page, removal_cause::erased);
+            page_map_.erase(key);
+            if(page->cache_slot == cache_slot::window)
+                window_.erase(page);
+            else
+                main_.erase(page);
+        }
+    }
 
-    // Allocated 99% of the total capacity.
-    slru main_;
+private:
+    // After an incremental shrink, the number of excess entries evicted per insertion.
+    // Since an insertion adds at most one entry, the excess shrinks with each one.
+    static constexpr int max_excess_evictions_per_insert = 4;
 
-    // Statistics.
-    int num_cache_hits_ = 0;
-    int num_cache_misses_ = 0;
+    int window_capacity(const int total_capacity) const noexcept
+    {
+        return window_capacity(total_capacity, window_ratio_);
+    }
 
-public:
-    explicit wtinylfu_cache(int capacity)
-        : filter_(capacity)
-        , window_(window_capacity(capacity))
-        , main_(capacity - window_.capacity())
-    {}
+    static int window_capacity(const int total_capacity, const float window_ratio) noexcept
+    {
+        return std::max(1, int(std::ceil(window_ratio * total_capacity)));
+    }
 
-    int size() const noexcept
+    void insert(const K& key, std::shared_ptr<V> data, const bool is_dirty = false)
     {
-        return window_.size() + main_.size();
+        auto it = page_map_.find(key);
+        if(it != nullptr)
+        {
+            // Replacing a value doesn't take up more space, so nothing is evicted.
+            auto page = *it;
+            replace_data(page, data);
+            if(is_dirty)
+                mark_dirty(page);
+            else if(page->dirty_generation != 0)
+                mark_clean(page);
+            return;
+        }
+
+        if(window_.is_full()) { evict(); }
+        auto page = window_.insert(key, cache_slot::window, data);
+        page_map_.insert(page);
+        if(is_dirty) { mark_dirty(page); }
+
+        if(size() > capacity()) { evict_excess(max_excess_evictions_per_insert); }
     }
 
-    int capacity() const noexcept
+#ifdef WTINYLFU_HAS_MMAP
+    using is_mappable = std::integral_constant<bool,
+        std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value
+        && alignof(V) <= snapshot::mapped_alignment>;
+#else
+    using is_mappable = std::false_type;
+#endif
+
+    template<typename Codec>
+    void save_snapshot_file(std::ostream& out, const Codec& codec, std::false_type) const
     {
-        return window_.capacity() + main_.capacity();
+        save_snapshot(out, codec);
     }
 
-    int num_cache_hits() const noexcept { return num_cache_hits_; }
-    int num_cache_misses() const noexcept { return num_cache_misses_; }
+    template<typename Codec>
+    void load_snapshot_file(const std::string& path, const Codec& codec, std::false_type)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if(!in) { throw std::runtime_error("could not open " + path); }
+        load_snapshot(in, codec);
+    }
 
-    bool contains(const K& key) const noexcept
+    template<typename Codec>
+    void save_snapshot_file(std::ostream& out, const Codec&, std::true_type) const
     {
-        return page_map_.find(key) != page_map_.cend();
+        const lru* segments[] = { &main_.eden(), &main_.probationary(), &window_ };
+        const uint64_t num_pages = size();
+
+        snapshot::mapped_header header{};
+        header.magic = snapshot::mapped_magic;
+        header.version = snapshot::mapped_version;
+        for(auto i = 0; i < 3; ++i) { header.num_pages[i] = segments[i]->size(); }
+        header.key_size = sizeof(K);
+        header.value_size = sizeof(V);
+        header.keys_offset = sizeof header;
+        header.values_offset = snapshot::align_up(
+            header.keys_offset + num_pages * sizeof(K), snapshot::mapped_alignment);
+        header.sketch_offset = snapshot::align_up(
+            header.values_offset + num_pages * sizeof(V), snapshot::mapped_alignment);
+        snapshot::write_pod(out, header);
+
+        for(const auto* segment : segments)
+        {
+            for(const auto& page : *segment) { snapshot::write_pod(out, page.key); }
+        }
+        snapshot::write_padding(out, snapshot::mapped_alignment);
+        for(const auto* segment : segments)
+        {
+            for(const auto& page : *segment) { snapshot::write_pod(out, *page.data); }
+        }
+        snapshot::write_padding(out, snapshot::mapped_alignment);
+        filter_.save(out);
     }
 
-    /**
-     * NOTE: after this operation the accuracy of the cache will suffer until enough
-     * historic data is gathered (because the frequency sketch is cleared).
-     */
-    void change_capacity(const int n)
+#ifdef WTINYLFU_HAS_MMAP
+    template<typename Codec>
+    void load_snapshot_file(const std::string& path, const Codec&, std::true_type)
     {
-        if(n <= 0)
+        auto file = std::make_shared<mapped_file>(path);
+        snapshot::mapped_header header;
+        if(file->size() < sizeof header)
         {
-            throw std::invalid_argument("cache capacity must be greater than zero");
+            throw std::runtime_error("not a wtinylfu snapshot");
+        }
+        std::memcpy(&header, file->data(), sizeof header);
+        if(header.magic != snapshot::mapped_magic)
+        {
+            throw std::runtime_error("not a wtinylfu snapshot");
+        }
+        if(header.version != snapshot::mapped_version
+           || header.key_size != sizeof(K) || header.value_size != sizeof(V))
+        {
+            throw std::runtime_error("incompatible wtinylfu snapshot");
         }
 
-        filter_.change_capacity(n);
-        window_.set_capacity(window_capacity(n));
-        main_.set_capacity(n - window_.capacity());
+        // The sections must be in order and within the file, and the page counts are
+        // bounded by dividing the section sizes, as multiplying corrupt counts by the
+        // key or value size could overflow.
+        if(header.keys_offset < sizeof header
+           || header.keys_offset > header.values_offset
+           || header.values_offset > header.sketch_offset
+           || header.sketch_offset > file->size()
+           || header.values_offset % snapshot::mapped_alignment != 0)
+        {
+            throw std::runtime_error("corrupt wtinylfu snapshot");
+        }
+        const uint64_t max_pages = std::min(
+            (header.values_offset - header.keys_offset) / sizeof(K),
+            (header.sketch_offset - header.values_offset) / sizeof(V));
+        uint64_t num_pages = 0;
+        for(const uint64_t n : header.num_pages)
+        {
+            if(n > max_pages - num_pages)
+            {
+                throw std::runtime_error("corrupt wtinylfu snapshot");
+            }
+            num_pages += n;
+        }
 
-        while(window_.is_full()) { evict_from_window(); }
-        while(main_.is_full()) { evict_from_main(); }
+        filter_.load(file->data() + header.sketch_offset,
+            file->size() - header.sketch_offset);
+        filter_.change_capacity(capacity());
+        clear();
+
+        const cache_slot slots[] = {
+            cache_slot::eden, cache_slot::probationary, cache_slot::window
+        };
+        const char* keys = file->data() + header.keys_offset;
+        char* values = file->data() + header.values_offset;
+        uint64_t index = 0;
+        for(auto s = 0; s < 3; ++s)
+        {
+            for(uint64_t i = 0; i < header.num_pages[s]; ++i, ++index)
+            {
+                K key;
+                std::memcpy(&key, keys + index * sizeof(K), sizeof(K));
+                // Shares ownership of the mapping rather than owning the value.
+                std::shared_ptr<V> data(file,
+                    reinterpret_cast<V*>(values + index * sizeof(V)));
+                restore_page(std::move(key), slots[s], std::move(data));
+            }
+        }
     }
+#endif
 
-    std::shared_ptr<V> get(const K& key)
+    template<typename Codec>
+    static void save_segment(std::ostream& out, const lru& segment, const Codec& codec)
     {
-        filter_.record_access(key);
-        auto it = page_map_.find(key);
-        if(it != page_map_.end())
+        snapshot::write_pod(out, uint64_t(segment.size()));
+        for(const auto& page : segment)
         {
-            auto& page = it->second;
-            handle_hit(page);
-            return page->data;
+            codec.write_key(out, page.key);
+            codec.write_value(out, *page.data);
         }
-        ++num_cache_misses_;
-        return nullptr;
     }
 
-    std::shared_ptr<V> operator[](const K& key)
+    template<typename Codec>
+    void load_segment(std::istream& in, const cache_slot slot, const Codec& codec)
     {
-        return get(key);
+        const auto num_pages = snapshot::read_pod<uint64_t>(in);
+        for(uint64_t i = 0; i < num_pages; ++i)
+        {
+            K key = codec.read_key(in);
+            auto data = std::make_shared<V>(codec.read_value(in));
+            restore_page(std::move(key), slot, std::move(data));
+        }
     }
 
-    template<typename ValueLoader>
-    std::shared_ptr<V> get_and_insert_if_missing(const K& key, ValueLoader value_loader)
+    /**
+     * Inserts a page read from a snapshot at the LRU position of its segment (see
+     * load_snapshot).
+     */
+    void restore_page(K key, const cache_slot slot, std::shared_ptr<V> data)
     {
-        std::shared_ptr<V> value = get(key);
-        if(value == nullptr)
+        if(contains(key)) { return; }
+
+        typename lru::page_position pos;
+        if(slot == cache_slot::window && !window_.is_full())
+            pos = window_.append(std::move(key), slot, std::move(data));
+        else if(!main_.append(pos, key, slot, std::move(data)))
+            return;
+        page_map_.insert(pos);
+    }
+
+    /**
+     * Resolves a lookup whose access has already been recorded in $filter_, where
+     * $key_hash is the key's hash computed by $page_map_.
+     */
+    std::shared_ptr<V> lookup(const K& key, const std::size_t key_hash)
+    {
+        auto it = page_map_.find(key, key_hash);
+        observe_access(key_hash, it != nullptr);
+        if(it != nullptr)
         {
-            value = std::make_shared<V>(value_loader(key));
-            insert(key, value);
+            auto page = *it;
+            handle_hit(page);
+            return page->data;
         }
-        return value;
+        ++num_cache_misses_;
+        return nullptr;
     }
 
-    void insert(K key, V value)
+    /**
+     * Inserts all pages into the window first and only then evicts the window's
+     * overflow, rather than checking for eviction before every insertion.
+     */
+    void insert_batch(const std::vector<K>& keys,
+        const std::vector<std::shared_ptr<V>>& data)
     {
-        insert(std::move(key), std::make_shared<V>(std::move(value)));
+        for(auto i = 0; i < int(keys.size()); ++i)
+        {
+            auto it = page_map_.find(keys[i]);
+            if(it != nullptr)
+                replace_data(*it, data[i]);
+            else
+                page_map_.insert(
+                    window_.insert(keys[i], cache_slot::window, data[i]));
+        }
+        evict_window_overflow();
+
+        if(size() > capacity())
+        {
+            evict_excess(max_excess_evictions_per_insert * int(keys.size()));
+        }
     }
 
-    void erase(const K& key)
+    /**
+     * Moves window victims into the main cache, or lets them duel with the main
+     * cache's victim if it's full, until the window is within its capacity.
+     */
+    void evict_window_overflow()
     {
-        auto it = page_map_.find(key);
-        if(it != page_map_.end())
+        while(window_.size() > window_.capacity())
         {
-            auto& page = it->second;
-            if(page->cache_slot == cache_slot::window)
-                window_.erase(page);
+            if(main_.is_full())
+                evict_from_window_or_main();
             else
-                main_.erase(page);
-            page_map_.erase(it);
+                main_.transfer_page_from(window_.lru_pos(), window_);
         }
     }
 
-private:
-    static int window_capacity(const int total_capacity) noexcept
+    /**
+     * Reports a lookup of the key with $key_hash (see lookup) to the attached access
+     * observers, if any.
+     */
+    void observe_access(const std::size_t key_hash, const bool is_hit)
     {
-        return std::max(1, int(std::ceil(0.01f * total_capacity)));
+        if(!trace_recorder_ && !mrc_estimator_ && shadow_caches_.empty()) { return; }
+
+        const uint32_t hash = detail::fold_hash(key_hash);
+        if(trace_recorder_) { trace_recorder_->record(hash, is_hit); }
+        if(mrc_estimator_) { mrc_estimator_->record_access(hash); }
+        if(!shadow_caches_.empty())
+        {
+            const uint32_t mixed_hash = detail::mix(hash);
+            for(auto& shadow : shadow_caches_)
+            {
+                if(mixed_hash < shadow.sampling_threshold)
+                {
+                    shadow.cache->simulate_access(hash);
+                }
+            }
+        }
     }
 
-    void insert(const K& key, std::shared_ptr<V> data)
+    /**
+     * Performs a lookup of $key and, if it's a miss, inserts it without a value, as
+     * if the value had been loaded. Used to run shadow caches.
+     */
+    void simulate_access(const K& key)
     {
-        if(window_.is_full()) { evict(); }
-
+        filter_.record_access(key);
         auto it = page_map_.find(key);
-        if(it != page_map_.end())
-            it->second->data = data;
+        if(it != nullptr)
+        {
+            handle_hit(*it);
+        }
         else
-            page_map_.emplace(key, window_.insert(key, cache_slot::window, data));
+        {
+            ++num_cache_misses_;
+            insert(key, std::shared_ptr<V>());
+        }
     }
 
     void handle_hit(typename lru::page_position page)
@@ -435,7 +1323,9 @@ private:
      * If the cache's total size exceeds its capacity, the window cache's victim and
      * the main cache's eviction candidate are evaluated and the one with the worse
      * (estimated) access frequency is evicted. Otherwise, the window cache's victim is
-     * just transferred to the main cache.
+     * just transferred to the main cache. If the main cache is empty, which may be
+     * the case after an incremental shrink, the window cache's victim is evicted as
+     * there is no main victim to weigh it against.
      */
     void evict()
     {
@@ -447,30 +1337,144 @@ private:
 
     void evict_from_window_or_main()
     {
+        if(main_.size() == 0)
+        {
+            evict_from_window(removal_cause::evicted);
+            return;
+        }
+
         const int window_victim_freq = filter_.frequency(window_.victim_key());
-        const int main_victim_freq = filter_.frequency(main_.victim_key());
-        if(window_victim_freq > main_victim_freq)
+        int main_victim_freq;
+        auto main_victim = select_main_victim(main_victim_freq);
+        if(admission_.admit(window_victim_freq, main_victim_freq))
         {
-            evict_from_main();
+            evict_from_main(main_victim);
             main_.transfer_page_from(window_.lru_pos(), window_);
         }
         else
         {
-            evict_from_window();
+            evict_from_window(removal_cause::rejected);
         }
     }
 
+    /**
+     * Returns the least frequently used of the main cache's eviction candidates (see
+     * admission_policy.hpp), and its frequency in $frequency.
+     */
+    typename lru::page_position select_main_victim(int& frequency)
+    {
+        auto victim = main_.victim_pos();
+        frequency = filter_.frequency(victim->key);
+        if(Admission::num_candidates <= 1
+            || victim->cache_slot != cache_slot::probationary)
+        {
+            return victim;
+        }
+
+        auto page = victim;
+        const auto first = main_.probationary().begin();
+        for(auto i = 1; i < Admission::num_candidates && page != first; ++i)
+        {
+            --page;
+            if(page->reference_count > 0) { continue; }
+            const int page_frequency = filter_.frequency(page->key);
+            if(page_frequency < frequency)
+            {
+                victim = page;
+                frequency = page_frequency;
+            }
+        }
+        return victim;
+    }
+
     void evict_from_main()
     {
-        page_map_.erase(main_.victim_key());
-        main_.evict();
+        evict_from_main(main_.victim_pos());
+    }
+
+    void evict_from_main(typename lru::page_position page)
+    {
+        retire(page, removal_cause::evicted);
+        // The policy's own victim is evicted through it, as it may keep track of it.
+        const bool is_policy_victim = page == main_.victim_pos();
+        page_map_.erase(page->key);
+        if(is_policy_victim)
+            main_.evict();
+        else
+            main_.erase(page);
     }
 
-    void evict_from_window()
+    void evict_from_window(const removal_cause cause)
     {
+        retire(window_.lru_pos(), cause);
         page_map_.erase(window_.victim_key());
         window_.evict();
     }
+
+    void replace_data(typename lru::page_position page, std::shared_ptr<V> data)
+    {
+        retire(page, removal_cause::replaced);
+        page->data = std::move(data);
+    }
+
+    /**
+     * Called with the page of each entry (or value) right before it's removed from
+     * the cache. Notifies the removal listener and, if reclamation is deferred,
+     * moves the value to the reclaim queue.
+     */
+    void retire(typename lru::page_position page, const removal_cause cause)
+    {
+        // A replaced value is superseded by the new one, so it's not written back.
+        if(page->dirty_generation != 0 && cause != removal_cause::replaced)
+        {
+            mark_clean(page);
+            if(flush_callback_) { flush_callback_(page->key, page->data); }
+        }
+        if(removal_listener_)
+        {
+            if(removal_delivery_ == removal_delivery::batched)
+                removal_notifications_.push_back({page->key, page->data, cause});
+            else
+                removal_listener_(page->key, page->data, cause);
+        }
+        if(defer_reclamation_ && page->data)
+        {
+            reclaim_queue_.push_back(std::move(page->data));
+        }
+    }
+
+    void mark_dirty(typename lru::page_position page)
+    {
+        if(page->dirty_generation != 0) { return; }
+        // Zero means clean, so it's skipped on wrap around. A stale mark that matches
+        // a reused generation only gets its entry written back early.
+        if(++last_dirty_generation_ == 0) { ++last_dirty_generation_; }
+        page->dirty_generation = last_dirty_generation_;
+        ++num_dirty_;
+
+        // Stale marks are otherwise only dropped when they reach the front, so keep
+        // them from piling up if dirty entries are mostly flushed by evictions.
+        if(int(dirty_keys_.size()) >= 2 * num_dirty_ + 64)
+        {
+            dirty_keys_.erase(std::remove_if(dirty_keys_.begin(), dirty_keys_.end(),
+                [this](const dirty_mark& mark) { return !is_live(mark); }),
+                dirty_keys_.end());
+        }
+        dirty_keys_.push_back(
+            {page->key, page->dirty_generation, std::chrono::steady_clock::now()});
+    }
+
+    void mark_clean(typename lru::page_position page) noexcept
+    {
+        page->dirty_generation = 0;
+        --num_dirty_;
+    }
+
+    bool is_live(const dirty_mark& mark) const
+    {
+        auto it = page_map_.find(mark.key);
+        return it != nullptr && (*it)->dirty_generation == mark.generation;
+    }
 };
 
 #endif